@@ -0,0 +1,107 @@
+/*
+ * Copyright 2016 Emaad Ahmed Manzoor
+ * License: Apache License, Version 2.0
+ * http://www3.cs.stonybrook.edu/~emanzoor/streamspot/
+ */
+
+#include "anomaly_index.h"
+#include <queue>
+#include <utility>
+#include <vector>
+
+namespace std {
+
+// whether graph a is more anomalous than graph b
+static inline bool more_anomalous(const anomaly_index& index, uint32_t a,
+                                  uint32_t b) {
+  return index.scores[a] > index.scores[b] ||
+         (index.scores[a] == index.scores[b] && a < b);
+}
+
+static inline void place(anomaly_index& index, uint32_t pos, uint32_t gid) {
+  index.heap[pos] = gid;
+  index.positions[gid] = pos;
+}
+
+static void sift_up(anomaly_index& index, uint32_t pos) {
+  uint32_t gid = index.heap[pos];
+  while (pos > 0) {
+    uint32_t parent = (pos - 1) / 2;
+    if (!more_anomalous(index, gid, index.heap[parent]))
+      break;
+    place(index, pos, index.heap[parent]);
+    pos = parent;
+  }
+  place(index, pos, gid);
+}
+
+static void sift_down(anomaly_index& index, uint32_t pos) {
+  uint32_t gid = index.heap[pos];
+  uint32_t n = index.heap.size();
+  while (2 * pos + 1 < n) {
+    uint32_t child = 2 * pos + 1;
+    if (child + 1 < n &&
+        more_anomalous(index, index.heap[child + 1], index.heap[child])) {
+      child++;
+    }
+    if (!more_anomalous(index, index.heap[child], gid))
+      break;
+    place(index, pos, index.heap[child]);
+    pos = child;
+  }
+  place(index, pos, gid);
+}
+
+void init_anomaly_index(anomaly_index& index, uint32_t num_graphs) {
+  index.heap.clear();
+  index.positions.assign(num_graphs, NOT_INDEXED);
+  index.scores.assign(num_graphs, 0.0);
+}
+
+// Sets the score of a graph, adding it if it has none yet.
+void update_anomaly_index(anomaly_index& index, uint32_t gid, double score) {
+  uint32_t pos = index.positions[gid];
+  if (pos == NOT_INDEXED) {
+    index.scores[gid] = score;
+    index.heap.push_back(gid);
+    index.positions[gid] = index.heap.size() - 1;
+    sift_up(index, index.heap.size() - 1);
+    return;
+  }
+
+  double old_score = index.scores[gid];
+  index.scores[gid] = score;
+  if (score > old_score) {
+    sift_up(index, pos);
+  } else if (score < old_score) {
+    sift_down(index, pos);
+  }
+}
+
+// The k most anomalous graphs and their scores, the most anomalous first.
+// Only the heap entries above them and their children are visited.
+vector<pair<uint32_t,double>> top_anomalies(const anomaly_index& index,
+                                            uint32_t k) {
+  vector<pair<uint32_t,double>> top;
+  auto less_anomalous = [&](uint32_t a, uint32_t b) {
+    return more_anomalous(index, index.heap[b], index.heap[a]);
+  };
+  priority_queue<uint32_t,vector<uint32_t>,decltype(less_anomalous)>
+    frontier(less_anomalous); // heap positions
+  if (!index.heap.empty()) {
+    frontier.push(0);
+  }
+  while (top.size() < k && !frontier.empty()) {
+    uint32_t pos = frontier.top();
+    frontier.pop();
+    uint32_t gid = index.heap[pos];
+    top.push_back(make_pair(gid, index.scores[gid]));
+    for (uint32_t child = 2 * pos + 1;
+         child <= 2 * pos + 2 && child < index.heap.size(); child++) {
+      frontier.push(child);
+    }
+  }
+  return top;
+}
+
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright 2016 Emaad Ahmed Manzoor
+ * License: Apache License, Version 2.0
+ * http://www3.cs.stonybrook.edu/~emanzoor/streamspot/
+ */
+
+#ifndef STREAMSPOT_ANOMALY_INDEX_H_
+#define STREAMSPOT_ANOMALY_INDEX_H_
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace std {
+
+#define NOT_INDEXED 0xffffffffu
+
+/* Max-heap of the scored graphs by anomaly score, ties broken by the lower
+ * gid, with the heap position of every graph so that a score is updated in
+ * O(log n). The k most anomalous graphs are found in O(k log k) by walking
+ * down from the root.
+ */
+struct anomaly_index {
+  vector<uint32_t> heap;                   // gids, the most anomalous first
+  vector<uint32_t> positions;              // of each gid, or NOT_INDEXED
+  vector<double> scores;                   // by gid
+};
+
+void init_anomaly_index(anomaly_index& index, uint32_t num_graphs);
+void update_anomaly_index(anomaly_index& index, uint32_t gid, double score);
+vector<pair<uint32_t,double>> top_anomalies(const anomaly_index& index,
+                                            uint32_t k);
+
+}
+
+#endif
@@ -0,0 +1,342 @@
+/*
+ * Copyright 2016 Emaad Ahmed Manzoor
+ * License: Apache License, Version 2.0
+ * http://www3.cs.stonybrook.edu/~emanzoor/streamspot/
+ */
+
+#include <algorithm>
+#include "chunk.h"
+#include <cstring>
+#include <deque>
+#include "hash.h"
+#include "isa.h"
+#include <memory>
+#include <mutex>
+#include "param.h"
+#include "streamhash.h"
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace std {
+
+#define LONG_CHUNK 0xffu // length byte of a fingerprinted chunk
+
+template<uint32_t W>
+struct chunk_entry {
+  uint64_t bits[CHUNK_HASH_WORDS(W)];  // hash bits, see hash_chunk
+  bool hashed;                         // whether bits is filled in
+};
+
+// Process-wide dictionary tables, shared by all threads and guarded by
+// chunk_mutex. Deques never move their elements, so references into them
+// stay valid without the lock, and entries are not modified once filled in.
+static mutex chunk_mutex;
+
+// chunk dictionary, off unless enabled
+static bool dictionary_enabled = false;
+static unordered_map<chunk_key,uint32_t> chunk_ids;
+
+// hash bits by chunk id for sketch width W, grown as chunks are hashed
+template<uint32_t W>
+static deque<chunk_entry<W>>& chunk_entries() {
+  static deque<chunk_entry<W>> entries;
+  return entries;
+}
+
+static inline uint32_t packed_length(const chunk_key& key) {
+  return static_cast<uint32_t>(key.hi >> 56);
+}
+
+static inline uint8_t packed_char(const chunk_key& key, uint32_t j) {
+  uint64_t word = j < 8 ? key.lo : key.hi;
+  return static_cast<uint8_t>(word >> (8 * (j % 8)));
+}
+
+// 64-bit hash of a chunk's characters, a word at a time, for fingerprints.
+// Different seeds give independent enough hashes for a 120-bit fingerprint.
+static uint64_t fingerprint_chunk(const char* p, uint32_t length,
+                                  uint64_t seed, uint64_t multiplier) {
+  uint64_t h = seed ^ (length * 0x9e3779b97f4a7c15ull);
+  for (uint32_t j = 0; j < length; j += 8) {
+    uint64_t word = 0;
+    memcpy(&word, p + j, min(8u, length - j));
+    h ^= word * multiplier;
+    h = ((h << 31) | (h >> 33)) * 0x9e3779b97f4a7c15ull;
+  }
+  h ^= h >> 33; // MurmurHash3 finalizer
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  return h ^ (h >> 33);
+}
+
+chunk_key make_chunk_key(const string& s, uint32_t offset, uint32_t length) {
+  chunk_key key = { 0, 0 };
+
+  if (length > MAX_PACKED_CHUNK_LENGTH) {
+    const char* p = s.data() + offset;
+    key.lo = fingerprint_chunk(p, length, 0x243f6a8885a308d3ull,
+                               0x87c37b91114253d5ull);
+    key.hi = fingerprint_chunk(p, length, 0x13198a2e03707344ull,
+                               0x4cf5ad432745937full) >> 8;
+    key.hi |= static_cast<uint64_t>(LONG_CHUNK) << 56;
+    key.chunk = make_shared<const string>(p, length);
+    return key;
+  }
+
+  for (uint32_t j = 0; j < length; j++) {
+    uint64_t c = static_cast<uint8_t>(s[offset + j]);
+    if (j < 8) {
+      key.lo |= c << (8 * j);
+    } else {
+      key.hi |= c << (8 * (j - 8));
+    }
+  }
+  key.hi |= static_cast<uint64_t>(length) << 56;
+  return key;
+}
+
+chunk_key make_chunk_key(const string& s) {
+  return make_chunk_key(s, 0, s.length());
+}
+
+string chunk_string(const chunk_key& key) {
+  uint32_t length = packed_length(key);
+  if (length == LONG_CHUNK)
+    return *key.chunk;
+
+  string chunk(length, ' ');
+  for (uint32_t j = 0; j < length; j++) {
+    chunk[j] = static_cast<char>(packed_char(key, j));
+  }
+  return chunk;
+}
+
+// Points *bytes at the chunk's characters and returns its length. Packed
+// chunks are unpacked into buffer, which must hold MAX_PACKED_CHUNK_LENGTH
+// bytes.
+uint32_t chunk_bytes(const chunk_key& key, const uint8_t** bytes,
+                     uint8_t* buffer) {
+  uint32_t length = packed_length(key);
+  if (length == LONG_CHUNK) {
+    auto& s = *key.chunk;
+    *bytes = reinterpret_cast<const uint8_t*>(s.data());
+    return s.length();
+  }
+
+  // length <= MAX_PACKED_CHUNK_LENGTH here, spelled out for the compiler
+  for (uint32_t j = 0; j < length && j < MAX_PACKED_CHUNK_LENGTH; j++) {
+    buffer[j] = packed_char(key, j);
+  }
+  *bytes = buffer;
+  return length;
+}
+
+// Same hash as hashmulti on the chunk's string.
+int hashmulti(const chunk_key& key, const vector<uint64_t>& randbits) {
+  uint32_t length = packed_length(key);
+  if (length == LONG_CHUNK)
+    return hashmulti(*key.chunk, randbits);
+
+  uint64_t sum = randbits[0];
+  for (uint32_t j = 0; j < length; j++) {
+    sum += randbits[j+1] * packed_char(key, j);
+  }
+  return 2 * static_cast<int>((sum >> 63) & 1) - 1; // MSB
+}
+
+/* The dictionary gives every distinct chunk seen by the bootstrap or the
+ * streaming path a dense id, and memoizes its W hash bits so that each chunk
+ * is hashed once per process. It grows with the number of distinct chunks,
+ * hence it is optional. All callers must use the same hash family H.
+ * It must be enabled before any chunk is hashed.
+ */
+void enable_chunk_dictionary() {
+  dictionary_enabled = true;
+}
+
+bool chunk_dictionary_enabled() {
+  return dictionary_enabled;
+}
+
+uint32_t chunk_dictionary_size() {
+  lock_guard<mutex> lock(chunk_mutex);
+  return chunk_ids.size();
+}
+
+// caller holds chunk_mutex
+static uint32_t get_chunk_id_locked(const chunk_key& key) {
+  auto it = chunk_ids.find(key);
+  if (it == chunk_ids.end()) {
+    // the fingerprint is enough, the characters are only needed to hash
+    chunk_key fingerprint = { key.lo, key.hi };
+    it = chunk_ids.insert(make_pair(fingerprint, chunk_ids.size())).first;
+  }
+  return it->second;
+}
+
+uint32_t get_chunk_id(const chunk_key& key) {
+  lock_guard<mutex> lock(chunk_mutex);
+  return get_chunk_id_locked(key);
+}
+
+// Hash bits of a chunk of up to C characters for C > 0, where the loop over
+// the characters is known to run at most C times, or of any length for
+// C = 0. Unlike in hash_tile, the loop is short and runs once per function,
+// and bounding it is faster than unrolling it.
+template<uint32_t C>
+static ALWAYS_INLINE void hash_chunk_bits(const uint8_t* chunk,
+                                          uint32_t length,
+                                          const vector<vector<uint64_t>>& H,
+                                          uint32_t num_functions,
+                                          uint64_t* out) {
+  for (uint32_t w = 0; w < CHUNK_HASH_WORDS(num_functions); w++) {
+    out[w] = 0;
+  }
+  uint32_t n = C > 0 ? min(C, length) : length;
+  for (uint32_t i = 0; i < num_functions; i++) {
+    auto& randbits = H[i];
+    uint64_t sum = randbits[0];
+    for (uint32_t j = 0; j < n; j++) {
+      sum += randbits[j+1] * chunk[j];
+    }
+    out[i / 64] |= (sum >> 63) << (i % 64); // MSB
+  }
+}
+
+// hash_chunk_bits for the chunk length of H, compiled for each instruction
+// set
+static void hash_chunk_bits_scalar(const uint8_t* chunk, uint32_t length,
+                                   const vector<vector<uint64_t>>& H,
+                                   uint32_t num_functions, uint64_t* out) {
+  DISPATCH_CHUNK_LENGTH(H[0].size() - 2, hash_chunk_bits, chunk, length, H,
+                        num_functions, out);
+}
+
+static TARGET_AVX2 void hash_chunk_bits_avx2(const uint8_t* chunk,
+                                             uint32_t length,
+                                             const vector<vector<uint64_t>>& H,
+                                             uint32_t num_functions,
+                                             uint64_t* out) {
+  DISPATCH_CHUNK_LENGTH(H[0].size() - 2, hash_chunk_bits, chunk, length, H,
+                        num_functions, out);
+}
+
+static TARGET_AVX512 void hash_chunk_bits_avx512(const uint8_t* chunk,
+                                                 uint32_t length,
+                                                 const vector<vector<uint64_t>>& H,
+                                                 uint32_t num_functions,
+                                                 uint64_t* out) {
+  DISPATCH_CHUNK_LENGTH(H[0].size() - 2, hash_chunk_bits, chunk, length, H,
+                        num_functions, out);
+}
+
+// Simple tabulation hash bits of a chunk: the base row XORed with the row of
+// each character, a word of 64 functions at a time.
+template<uint32_t W>
+static ALWAYS_INLINE void tabulate_chunk_bits(const uint8_t* chunk,
+                                              uint32_t length,
+                                              const uint64_t* tables,
+                                              uint64_t* out) {
+  const uint32_t num_words = CHUNK_HASH_WORDS(W);
+  for (uint32_t w = 0; w < num_words; w++) {
+    out[w] = tables[w];
+  }
+  for (uint32_t j = 0; j < length; j++) {
+    const uint64_t* row = tables + (1 + j * 256 + chunk[j]) * num_words;
+    for (uint32_t w = 0; w < num_words; w++) {
+      out[w] ^= row[w];
+    }
+  }
+}
+
+template<uint32_t W>
+static void tabulate_chunk_bits_scalar(const uint8_t* chunk, uint32_t length,
+                                       const uint64_t* tables, uint64_t* out) {
+  tabulate_chunk_bits<W>(chunk, length, tables, out);
+}
+
+template<uint32_t W>
+static TARGET_AVX2 void tabulate_chunk_bits_avx2(const uint8_t* chunk,
+                                                 uint32_t length,
+                                                 const uint64_t* tables,
+                                                 uint64_t* out) {
+  tabulate_chunk_bits<W>(chunk, length, tables, out);
+}
+
+template<uint32_t W>
+static TARGET_AVX512 void tabulate_chunk_bits_avx512(const uint8_t* chunk,
+                                                     uint32_t length,
+                                                     const uint64_t* tables,
+                                                     uint64_t* out) {
+  tabulate_chunk_bits<W>(chunk, length, tables, out);
+}
+
+// Bit i (see chunk_hash_bit) is set if hash function i of the family maps the
+// chunk to +1, for the W functions of the family; for multilinear hashing, if
+// hashmulti(key, H[i]) = +1. The bits are memoized in the dictionary if it is
+// enabled, and are otherwise only valid until the calling thread's next call.
+template<uint32_t W>
+const uint64_t* hash_chunk(const chunk_key& key, const hash_family& family) {
+  static thread_local uint64_t bits[CHUNK_HASH_WORDS(W)];
+  auto& entries = chunk_entries<W>();
+
+  if (dictionary_enabled) {
+    lock_guard<mutex> lock(chunk_mutex);
+    auto it = chunk_ids.find(key);
+    if (it != chunk_ids.end() && it->second < entries.size() &&
+        entries[it->second].hashed)
+      return entries[it->second].bits;
+  }
+
+  // hash outside the lock, other threads may hash the same chunk meanwhile
+  uint64_t* out = bits;
+
+  // unpack once rather than once per hash function
+  uint8_t buffer[MAX_PACKED_CHUNK_LENGTH];
+  const uint8_t* chunk;
+  uint32_t length = chunk_bytes(key, &chunk, buffer);
+
+  if (family.kind == HASH_TABULATION) {
+    const uint64_t* tables = family.tables.data();
+    switch (kernel_isa()) {
+      case ISA_AVX512:
+        tabulate_chunk_bits_avx512<W>(chunk, length, tables, out); break;
+      case ISA_AVX2:
+        tabulate_chunk_bits_avx2<W>(chunk, length, tables, out); break;
+      default:
+        tabulate_chunk_bits_scalar<W>(chunk, length, tables, out); break;
+    }
+  } else {
+    auto& H = family.H;
+    switch (kernel_isa()) {
+      case ISA_AVX512: hash_chunk_bits_avx512(chunk, length, H, W, out); break;
+      case ISA_AVX2:   hash_chunk_bits_avx2(chunk, length, H, W, out); break;
+      default:         hash_chunk_bits_scalar(chunk, length, H, W, out); break;
+    }
+  }
+
+  if (dictionary_enabled) {
+    lock_guard<mutex> lock(chunk_mutex);
+    uint32_t id = get_chunk_id_locked(key);
+    while (entries.size() <= id) {
+      entries.push_back(chunk_entry<W>());
+      entries.back().hashed = false;
+    }
+    auto& entry = entries[id];
+    if (!entry.hashed) {
+      copy(out, out + CHUNK_HASH_WORDS(W), entry.bits);
+      entry.hashed = true;
+    }
+    return entry.bits;
+  }
+  return out;
+}
+
+#define INSTANTIATE_HASH_CHUNK(W) \
+  template const uint64_t* hash_chunk<W>(const chunk_key& key, \
+                                         const hash_family& family);
+FOR_EACH_SKETCH_WIDTH(INSTANTIATE_HASH_CHUNK)
+
+}
@@ -0,0 +1,118 @@
+/*
+ * Copyright 2016 Emaad Ahmed Manzoor
+ * License: Apache License, Version 2.0
+ * http://www3.cs.stonybrook.edu/~emanzoor/streamspot/
+ */
+
+#ifndef STREAMSPOT_CHUNK_H_
+#define STREAMSPOT_CHUNK_H_
+
+#include <memory>
+#include "param.h"
+#include <string>
+#include <vector>
+
+namespace std {
+
+struct hash_family;
+
+// longest chunk packed inline, longer chunks are fingerprinted
+#define MAX_PACKED_CHUNK_LENGTH 15
+
+// 64-bit words holding one hash bit per hash function, for W functions
+#define CHUNK_HASH_WORDS(W) (((W) + 63) / 64)
+
+/* Calls f<C>(args...) for the common chunk lengths C, or f<0>(args...), the
+ * generic version, for any other chunk length. Kernels specialized on C can
+ * fully unroll their loops over chunk positions.
+ */
+#define DISPATCH_CHUNK_LENGTH(chunk_length, f, ...) \
+  switch (chunk_length) { \
+    case 4:  f<4>(__VA_ARGS__); break; \
+    case 8:  f<8>(__VA_ARGS__); break; \
+    case 10: f<10>(__VA_ARGS__); break; \
+    case 16: f<16>(__VA_ARGS__); break; \
+    case 25: f<25>(__VA_ARGS__); break; \
+    case 50: f<50>(__VA_ARGS__); break; \
+    default: f<0>(__VA_ARGS__); break; \
+  }
+
+/* A shingle chunk packed into two 64-bit words.
+ *
+ * Chunks of up to 15 characters are stored inline: character j in byte j
+ * (little-endian across lo, then hi) and the length in the top byte of hi.
+ * Longer chunks are keyed by a 120-bit fingerprint in lo and the low bytes
+ * of hi, with 0xff in the top byte, and own a copy of their characters for
+ * hashing. Equal chunks always have equal keys, and distinct chunks equal
+ * keys only if their fingerprints collide, so hashing and comparison are
+ * integer operations.
+ */
+struct chunk_key {
+  uint64_t lo;
+  uint64_t hi;
+  shared_ptr<const string> chunk;          // characters of a long chunk
+};
+
+inline bool operator==(const chunk_key& a, const chunk_key& b) {
+  return a.lo == b.lo && a.hi == b.hi;
+}
+
+inline bool operator!=(const chunk_key& a, const chunk_key& b) {
+  return !(a == b);
+}
+
+inline bool operator<(const chunk_key& a, const chunk_key& b) {
+  return a.hi < b.hi || (a.hi == b.hi && a.lo < b.lo);
+}
+
+template<> struct hash<chunk_key>
+{
+  inline size_t operator()(const chunk_key& key) const
+  {
+    uint64_t h = key.lo * 0x9e3779b97f4a7c15ull;
+    h ^= (h >> 32) ^ (key.hi * 0xc2b2ae3d27d4eb4full);
+    return h ^ (h >> 29);
+  }
+};
+
+chunk_key make_chunk_key(const string& s, uint32_t offset, uint32_t length);
+
+// make_chunk_key for exactly C characters at p, with the loop unrolled
+template<uint32_t C>
+inline chunk_key make_packed_chunk_key(const char* p) {
+  static_assert(C <= MAX_PACKED_CHUNK_LENGTH, "chunk too long to pack");
+  chunk_key key = { 0, 0 };
+  for (uint32_t j = 0; j < C; j++) {
+    uint64_t c = static_cast<uint8_t>(p[j]);
+    if (j < 8) {
+      key.lo |= c << (8 * j);
+    } else {
+      key.hi |= c << (8 * (j - 8));
+    }
+  }
+  key.hi |= static_cast<uint64_t>(C) << 56;
+  return key;
+}
+
+chunk_key make_chunk_key(const string& s);
+string chunk_string(const chunk_key& key);
+uint32_t chunk_bytes(const chunk_key& key, const uint8_t** bytes,
+                     uint8_t* buffer);
+int hashmulti(const chunk_key& key, const vector<uint64_t>& randbits);
+
+// optional dictionary of all chunks seen, with dense ids and hash bits
+void enable_chunk_dictionary();
+bool chunk_dictionary_enabled();
+uint32_t chunk_dictionary_size();
+uint32_t get_chunk_id(const chunk_key& key);
+template<uint32_t W>
+const uint64_t* hash_chunk(const chunk_key& key, const hash_family& family);
+
+// +1 or -1, hash function i's value in the words returned by hash_chunk
+inline int chunk_hash_bit(const uint64_t* bits, uint32_t i) {
+  return 2 * static_cast<int>((bits[i / 64] >> (i % 64)) & 1) - 1;
+}
+
+}
+
+#endif
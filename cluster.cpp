@@ -11,8 +11,10 @@
 #include <cmath>
 #include <iostream>
 #include "param.h"
+#include "quantile.h"
 #include <string>
 #include "streamhash.h"
+#include "thread_pool.h"
 #include <tuple>
 #include <unordered_map>
 #include <unordered_set>
@@ -20,117 +22,524 @@
 
 namespace std {
 
-void hash_bands(uint32_t gid, const bitset<L>& sketch,
-                vector<unordered_map<bitset<R>,vector<uint32_t>>>& hash_tables) {
+// Moves the buckets of a table into num_slots slots, a power of two.
+static void rehash_band_table(band_table& table, size_t num_slots) {
+  vector<band_slot> slots(num_slots,
+                          band_slot{0, NO_BAND_ENTRY, NO_BAND_ENTRY});
+  uint32_t mask = slots.size() - 1;
+  for (auto& slot : table.slots) {
+    if (slot.head == NO_BAND_ENTRY)
+      continue;
+    uint32_t s = band_slot_index(slot.band, mask);
+    while (slots[s].head != NO_BAND_ENTRY)
+      s = (s + 1) & mask;
+    slots[s] = slot;
+  }
+  table.slots.swap(slots);
+}
+
+// Sizes a table for num_entries graphs, so that inserting them neither
+// rehashes nor grows the entries.
+void reserve_band_table(band_table& table, uint32_t num_entries) {
+  size_t num_slots = max<size_t>(16, table.slots.size());
+  while (num_slots < 2 * static_cast<size_t>(num_entries))
+    num_slots *= 2;
+  if (num_slots > table.slots.size()) {
+    rehash_band_table(table, num_slots);
+  }
+  table.entries.reserve(num_entries);
+}
+
+// Appends gid to the bucket of graphs whose band has this value.
+void insert_band_entry(band_table& table, uint32_t band, uint32_t gid) {
+  if (2 * (table.num_buckets + 1) > table.slots.size()) {
+    // rehash into twice as many slots
+    rehash_band_table(table, max<size_t>(16, 2 * table.slots.size()));
+  }
+
+  uint32_t entry = table.free_entries;
+  if (entry != NO_BAND_ENTRY) {
+    table.free_entries = table.entries[entry].next;
+    table.entries[entry] = band_entry{gid, NO_BAND_ENTRY};
+  } else {
+    entry = table.entries.size();
+    table.entries.push_back(band_entry{gid, NO_BAND_ENTRY});
+  }
+
+  uint32_t mask = table.slots.size() - 1;
+  uint32_t s = band_slot_index(band, mask);
+  for (; table.slots[s].head != NO_BAND_ENTRY; s = (s + 1) & mask) {
+    auto& slot = table.slots[s];
+    if (slot.band == band) {
+      table.entries[slot.tail].next = entry;
+      slot.tail = entry;
+      return;
+    }
+  }
+  table.slots[s] = band_slot{band, entry, entry};
+  table.num_buckets++;
+}
+
+// Removes gid from the bucket of graphs whose band has this value, and the
+// bucket from the table if it becomes empty.
+void erase_band_entry(band_table& table, uint32_t band, uint32_t gid) {
+  if (table.slots.empty())
+    return;
+  uint32_t mask = table.slots.size() - 1;
+  uint32_t s = band_slot_index(band, mask);
+  while (table.slots[s].head != NO_BAND_ENTRY && table.slots[s].band != band)
+    s = (s + 1) & mask;
+  auto& slot = table.slots[s];
+  if (slot.head == NO_BAND_ENTRY)
+    return;
+
+  // unlink the entry and put it on the free list
+  uint32_t previous = NO_BAND_ENTRY;
+  uint32_t e = slot.head;
+  while (e != NO_BAND_ENTRY && table.entries[e].gid != gid) {
+    previous = e;
+    e = table.entries[e].next;
+  }
+  if (e == NO_BAND_ENTRY)
+    return;
+  if (previous == NO_BAND_ENTRY) {
+    slot.head = table.entries[e].next;
+  } else {
+    table.entries[previous].next = table.entries[e].next;
+  }
+  if (slot.tail == e) {
+    slot.tail = previous;
+  }
+  table.entries[e].next = table.free_entries;
+  table.free_entries = e;
+  if (slot.head != NO_BAND_ENTRY)
+    return;
+
+  // free the slot, shifting back later slots of the probe sequence that
+  // could otherwise no longer be reached
+  table.num_buckets--;
+  uint32_t hole = s;
+  for (uint32_t j = (s + 1) & mask; table.slots[j].head != NO_BAND_ENTRY;
+       j = (j + 1) & mask) {
+    uint32_t home = band_slot_index(table.slots[j].band, mask);
+    if (((j - home) & mask) >= ((j - hole) & mask)) {
+      table.slots[hole] = table.slots[j];
+      hole = j;
+    }
+  }
+  table.slots[hole] = band_slot{0, NO_BAND_ENTRY, NO_BAND_ENTRY};
+}
+
+void hash_bands(uint32_t gid, const uint64_t* sketch_words,
+                uint32_t num_words, vector<band_table>& hash_tables) {
 #ifdef DEBUG
   cout << "Hashing bands of GID: " << gid << endl;
 #endif
 
-  bitset<L> mask = bitset<L>(string(R, '1')); // R one's
-  for (uint32_t i = 0; i < B; i++) {
+  for (uint32_t i = 0; i < hash_tables.size(); i++) {
     // get the i'th R-bit band
-    string band_string = (sketch >> (R * i) & mask).to_string();
-    band_string = band_string.substr(band_string.length() - R, R);
-    bitset<R> band(band_string);
+    uint32_t band = sketch_band(sketch_words, num_words, i);
 #ifdef DEBUG
-    cout << "\tBand " << i << ": " << band.to_string() << endl;
+    cout << "\tBand " << i << ": " << bitset<R>(band).to_string() << endl;
 #endif
 
     // hash the band to a bucket in the i'th hash table and insert the gid
-    hash_tables[i][band].push_back(gid);
+    insert_band_entry(hash_tables[i], band, gid);
   }
 }
 
-bool is_isolated(const bitset<L>& sketch,
-                 const vector<unordered_map<bitset<R>,vector<uint32_t>>>&
-                    hash_tables) {
-  bitset<L> mask = bitset<L>(string(R, '1')); // R one's
-  for (uint32_t i = 0; i < B; i++) {
-    string band_string = (sketch >> (R * i) & mask).to_string();
-    band_string = band_string.substr(band_string.length() - R, R);
-    bitset<R> band(band_string);
-    if (hash_tables[i].find(band) != hash_tables[i].end()) {
+bool is_isolated(const uint64_t* sketch_words, uint32_t num_words,
+                 const vector<band_table>& hash_tables) {
+  for (uint32_t i = 0; i < hash_tables.size(); i++) {
+    uint32_t band = sketch_band(sketch_words, num_words, i);
+    if (find_band_bucket(hash_tables[i], band) != NO_BAND_ENTRY) {
       return false;
     }
   }
   return true;
 }
 
-void get_shared_bucket_graphs(const bitset<L>& sketch,
-                              const vector<unordered_map<bitset<R>,
-                                           vector<uint32_t>>>& hash_tables,
+void get_shared_bucket_graphs(const uint64_t* sketch_words,
+                              uint32_t num_words,
+                              const vector<band_table>& hash_tables,
                               unordered_set<uint32_t>& shared_bucket_graphs) {
-  bitset<L> mask = bitset<L>(string(R, '1')); // R one's
-  for (uint32_t i = 0; i < B; i++) {
+  for (uint32_t i = 0; i < hash_tables.size(); i++) {
     // get the i'th R-bit band
-    string band_string = (sketch >> (R * i) & mask).to_string();
-    band_string = band_string.substr(band_string.length() - R, R);
-    bitset<R> band(band_string);
-
-    for (auto& gid : hash_tables[i].at(band)) {
-      shared_bucket_graphs.insert(gid);
+    uint32_t band = sketch_band(sketch_words, num_words, i);
+    auto& entries = hash_tables[i].entries;
+    for (uint32_t e = find_band_bucket(hash_tables[i], band);
+         e != NO_BAND_ENTRY; e = entries[e].next) {
+      shared_bucket_graphs.insert(entries[e].gid);
     }
   }
 }
 
-tuple<vector<bitset<L>>, vector<vector<double>>>
-construct_centroid_sketches(const vector<vector<int>>& streamhash_projections,
+template<uint32_t W>
+tuple<vector<sign_sketch<W>>, vector<vector<double>>>
+construct_centroid_sketches(const vector<vector<double>>& streamhash_projections,
                             const vector<vector<uint32_t>>& clusters,
-                            uint32_t nclusters) {
-  vector<bitset<L>> centroid_sketches(nclusters);
-  vector<vector<double>> centroid_projections(nclusters, vector<double>(L, 0.0));
+                            uint32_t nclusters, thread_pool& pool) {
+  vector<sign_sketch<W>> centroid_sketches(nclusters);
+  vector<vector<double>> centroid_projections(nclusters, vector<double>(W, 0.0));
+
+  // each thread accumulates its own block of projection components, summing
+  // the graphs of a cluster in the same order as a single thread would
+  const uint32_t block_size = 64;
+  uint32_t num_blocks = (W + block_size - 1) / block_size;
+  pool.parallel_for(num_blocks, [&](uint32_t b) {
+    uint32_t begin = b * block_size;
+    uint32_t end = min(begin + block_size, W);
+    for (uint32_t c = 0; c < nclusters; c++) {
+      auto& centroid_p = centroid_projections[c];
+      for (auto& gid : clusters[c]) {
+        // add the projection vector of this graph to the centroid's
+        for (uint32_t l = begin; l < end; l++) {
+          centroid_p[l] += streamhash_projections[gid][l];
+        }
+      }
+      // now the block contains the sum of all projections of the cluster
+      for (uint32_t l = begin; l < end; l++) {
+        centroid_p[l] /= clusters[c].size();
+      }
+    }
+  });
+
+  for (uint32_t c = 0; c < nclusters; c++) {
+    centroid_sketches[c] = make_sign_sketch<W>(centroid_projections[c]);
+  }
+
+  return make_tuple(centroid_sketches, centroid_projections);
+}
+
+// Indexes the bands of all centroid sketches, refreshing them first, with
+// room for up to capacity clusters.
+template<uint32_t W>
+void build_centroid_index(centroid_index<W>& index,
+                          vector<sign_sketch<W>>& centroid_sketches,
+                          const vector<vector<double>>& centroid_projections,
+                          uint32_t capacity) {
+  uint32_t nclusters = centroid_sketches.size();
+  index.tables.assign(W / CENTROID_BAND_BITS, band_table());
+  for (auto& table : index.tables) {
+    reserve_band_table(table, capacity);
+  }
+  index.indexed.reserve(capacity);
+  index.indexed.resize(nclusters);
+  index.candidates.clear();
+  index.marks.reserve(capacity);
+  index.marks.assign(nclusters, 0);
+  index.search = 0;
+  index.num_searches = 0;
+  index.num_candidates = 0;
+  index.num_full_scans = 0;
 
   for (uint32_t c = 0; c < nclusters; c++) {
-    for (auto& gid : clusters[c]) {
-      // add the projection vector of this graph to the centroid's
-      for (uint32_t l = 0; l < L; l++) {
-        centroid_projections[c][l] += streamhash_projections[gid][l];
+    index.indexed[c] = refresh_sketch(centroid_sketches[c],
+                                      centroid_projections[c]);
+    for (uint32_t i = 0; i < index.tables.size(); i++) {
+      insert_band_entry(index.tables[i],
+                        sketch_band(index.indexed[c].words, SKETCH_WORDS(W), i,
+                                    CENTROID_BAND_BITS), c);
+    }
+  }
+}
+
+// Indexes the bands of a new cluster's centroid, the last one.
+template<uint32_t W>
+static void index_new_centroid(centroid_index<W>& index,
+                               const sign_sketch<W>& centroid_sketch) {
+  uint32_t c = index.indexed.size();
+  index.indexed.push_back(centroid_sketch);
+  index.marks.push_back(0);
+  for (uint32_t i = 0; i < index.tables.size(); i++) {
+    insert_band_entry(index.tables[i],
+                      sketch_band(centroid_sketch.words, SKETCH_WORDS(W), i,
+                                  CENTROID_BAND_BITS), c);
+  }
+}
+
+// Moves centroid c to the buckets of the bands of its current sketch, where
+// they changed since it was last indexed. A move flips few sign bits, so
+// only the bands holding flipped bits are visited.
+template<uint32_t W>
+static void reindex_centroid(centroid_index<W>& index, uint32_t c,
+                             sign_sketch<W>& centroid_sketch,
+                             const vector<double>& centroid_projection) {
+  auto& sketch = refresh_sketch(centroid_sketch, centroid_projection);
+  auto& indexed = index.indexed[c];
+  uint32_t last_band = NO_BAND_ENTRY;
+  for (uint32_t w = 0; w < SKETCH_WORDS(W); w++) {
+    uint64_t flipped = indexed.words[w] ^ sketch.words[w];
+    while (flipped != 0) {
+      uint32_t i = (64 * w + __builtin_ctzll(flipped)) / CENTROID_BAND_BITS;
+      uint32_t next_bit = (i + 1) * CENTROID_BAND_BITS - 64 * w;
+      flipped = next_bit < 64 ? flipped & (~0ull << next_bit) : 0;
+      if (i == last_band || i >= index.tables.size())
+        continue; // band spanning two words, or past the last band
+      last_band = i;
+
+      uint32_t old_band = sketch_band(indexed.words, SKETCH_WORDS(W), i,
+                                      CENTROID_BAND_BITS);
+      uint32_t new_band = sketch_band(sketch.words, SKETCH_WORDS(W), i,
+                                      CENTROID_BAND_BITS);
+      erase_band_entry(index.tables[i], old_band, c);
+      insert_band_entry(index.tables[i], new_band, c);
+    }
+  }
+  indexed = sketch;
+}
+
+// Clusters sharing at least one band with the sketch, in increasing order.
+template<uint32_t W>
+static const vector<uint32_t>&
+find_centroid_candidates(centroid_index<W>& index,
+                         const sign_sketch<W>& sketch) {
+  index.candidates.clear();
+  if (++index.search == 0) { // marks wrapped around
+    fill(index.marks.begin(), index.marks.end(), 0);
+    index.search = 1;
+  }
+
+  for (uint32_t i = 0; i < index.tables.size(); i++) {
+    auto& table = index.tables[i];
+    uint32_t band = sketch_band(sketch.words, SKETCH_WORDS(W), i,
+                                CENTROID_BAND_BITS);
+    for (uint32_t e = find_band_bucket(table, band); e != NO_BAND_ENTRY;
+         e = table.entries[e].next) {
+      uint32_t c = table.entries[e].gid;
+      if (index.marks[c] != index.search) {
+        index.marks[c] = index.search;
+        index.candidates.push_back(c);
       }
     }
   }
+  sort(index.candidates.begin(), index.candidates.end());
+
+  index.num_searches++;
+  index.num_candidates += index.candidates.size();
+  return index.candidates;
+}
+
+// Snapshots all centroid sketches, refreshing them first, and computes the
+// distances between them, with room for up to capacity clusters.
+template<uint32_t W>
+void build_centroid_bounds(centroid_bounds<W>& bounds,
+                           vector<sign_sketch<W>>& centroid_sketches,
+                           const vector<vector<double>>& centroid_projections,
+                           uint32_t capacity) {
+  static_assert(W <= 0xffff, "distances are 16-bit");
+  uint32_t nclusters = centroid_sketches.size();
+  bounds.capacity = capacity;
+  bounds.snapshots.reserve(capacity);
+  bounds.snapshots.resize(nclusters);
+  bounds.distances.assign(static_cast<size_t>(capacity) * capacity, 0);
+  bounds.drift.reserve(capacity);
+  bounds.drift.assign(nclusters, 0);
+  bounds.stale.reserve(capacity);
+  bounds.stale.assign(nclusters, 0);
+  bounds.num_distances = 0;
+  bounds.num_pruned = 0;
 
-  // now the centroid projections contain the sum of all projections of their cluster
   for (uint32_t c = 0; c < nclusters; c++) {
-    for (uint32_t l = 0; l < L; l++) {
-      centroid_projections[c][l] /= clusters[c].size();
-      centroid_sketches[c][l] = centroid_projections[c][l] >= 0 ? 1 : 0;
+    bounds.snapshots[c] = refresh_sketch(centroid_sketches[c],
+                                         centroid_projections[c]);
+  }
+  for (uint32_t i = 0; i < nclusters; i++) {
+    for (uint32_t j = 0; j < i; j++) {
+      uint16_t d = sketch_distance(bounds.snapshots[i], bounds.snapshots[j]);
+      bounds.distances[i * capacity + j] = d;
+      bounds.distances[j * capacity + i] = d;
     }
   }
+}
 
-  return make_tuple(centroid_sketches, centroid_projections);
+// Computes the distances of the snapshot of centroid c to the others.
+template<uint32_t W>
+static void snapshot_distances(centroid_bounds<W>& bounds, uint32_t c) {
+  uint32_t nclusters = bounds.snapshots.size();
+  for (uint32_t j = 0; j < nclusters; j++) {
+    uint16_t d = j == c ? 0 : sketch_distance(bounds.snapshots[c],
+                                              bounds.snapshots[j]);
+    bounds.distances[c * bounds.capacity + j] = d;
+    bounds.distances[j * bounds.capacity + c] = d;
+  }
+}
+
+// Updates the drift of centroid c after it moved, and its snapshot and
+// distances if it drifted too far.
+template<uint32_t W>
+static void update_centroid_bounds(centroid_bounds<W>& bounds, uint32_t c,
+                                   sign_sketch<W>& centroid_sketch,
+                                   const vector<double>& centroid_projection) {
+  auto& sketch = refresh_sketch(centroid_sketch, centroid_projection);
+  bounds.stale[c] = 0;
+  bounds.drift[c] = sketch_distance(sketch, bounds.snapshots[c]);
+  if (bounds.drift[c] <= W / CENTROID_DRIFT_FRACTION)
+    return;
+
+  bounds.snapshots[c] = sketch;
+  bounds.drift[c] = 0;
+  snapshot_distances(bounds, c);
+}
+
+// Brings the search structures up to date after centroid c moved.
+template<uint32_t W>
+static void centroid_moved(centroid_index<W>* index, centroid_bounds<W>& bounds,
+                           uint32_t c, sign_sketch<W>& centroid_sketch,
+                           const vector<double>& centroid_projection) {
+  if (index != nullptr) {
+    reindex_centroid(*index, c, centroid_sketch, centroid_projection);
+  }
+  bounds.stale[c] = 1;
 }
 
-void update_distances_and_clusters(uint32_t gid,
+// Distance of sketches Hamming distance h apart.
+template<uint32_t W>
+static inline double hamming_to_distance(uint32_t h) {
+  return 1.0 - cos(PI*(1.0 - static_cast<double>(W - h) / W));
+}
+
+// Distance of a graph to a centroid, whose sketch is refreshed if needed.
+template<uint32_t W>
+static double centroid_distance(const sign_sketch<W>& graph_sketch,
+                                sign_sketch<W>& centroid_sketch,
+                                const vector<double>& centroid_projection) {
+  refresh_sketch(centroid_sketch, centroid_projection);
+  return hamming_to_distance<W>(sketch_distance(graph_sketch, centroid_sketch));
+}
+
+/* Updates a graph's cluster and anomaly score after its projection changed
+ * by projection_delta, and moves the affected centroids.
+ *
+ * If search_centroids is false and the graph is in a cluster, its distance
+ * is only computed to its own centroid, which is assumed to still be the
+ * nearest. All centroids are searched anyway if that distance is over the
+ * threshold. Centroid projections are updated exactly either way. Returns
+ * whether the centroids were searched.
+ *
+ * With an index, only the candidate clusters sharing a band with the graph
+ * are searched, unless none of them is within its threshold: then all
+ * centroids are, so a graph is only made an anomaly by a full search. The
+ * index is updated as centroids move.
+ *
+ * A full search starts from the graph's cluster, or the first, and skips
+ * the centroids that bounds rule out: with b the nearest centroid so far,
+ * centroid i is at least d(b, i) - d(graph, b) from the graph. It finds the
+ * same nearest centroid as computing every distance, the first if tied.
+ * With cascade, the distance to a centroid is only computed as far as needed
+ * to tell that it is not nearer, see sketch_distance_below.
+ *
+ * With a calibration, the graph's distance to its nearest centroid is
+ * recorded for that cluster, whether it joins the cluster or not: members
+ * alone are all within the threshold, which would only ever shrink.
+ *
+ * A cluster left without graphs is retired: its centroid stays where it
+ * was, searches skip it, and spawn_clusters may reuse it.
+ */
+template<uint32_t W>
+bool update_distances_and_clusters(uint32_t gid,
                                    const vector<int>& projection_delta,
-                                   const vector<bitset<L>>& graph_sketches,
-                                   const vector<vector<int>>& graph_projections,
-                                   vector<bitset<L>>& centroid_sketches,
+                                   vector<sign_sketch<W>>& graph_sketches,
+                                   const vector<vector<double>>& graph_projections,
+                                   vector<sign_sketch<W>>& centroid_sketches,
                                    vector<vector<double>>& centroid_projections,
                                    vector<uint32_t>& cluster_sizes,
+                                   vector<uint32_t>& centroid_epochs,
+                                   uint32_t epoch, double decay,
                                    vector<int>& cluster_map,
                                    vector<double>& anomaly_scores,
                                    double anomaly_threshold,
-                                   const vector<double>& cluster_thresholds) {
-  // calculate distance of graph to all cluster centroids
-  uint32_t nclusters = cluster_sizes.size();
-  vector<double> distances(nclusters);
+                                   const vector<double>& cluster_thresholds,
+                                   bool search_centroids, bool cascade,
+                                   centroid_index<W>* index,
+                                   centroid_bounds<W>& bounds,
+                                   threshold_calibration* calibration) {
+  auto& graph_s = refresh_sketch(graph_sketches[gid], graph_projections[gid]);
   double min_distance = 5.0;
   int nearest_cluster = -1;
+
+  if (!search_centroids && cluster_map[gid] >= 0) {
+    int i = cluster_map[gid];
+    double distance = centroid_distance(graph_s, centroid_sketches[i],
+                                        centroid_projections[i]);
+    if (distance <= min(anomaly_threshold, cluster_thresholds[i])) {
+      min_distance = distance;
+      nearest_cluster = i;
+    }
+  }
+  bool searched = nearest_cluster == -1;
+  bool full_scan = searched;
+
+  // calculate distance of graph to the candidate cluster centroids
+  if (searched && index != nullptr) {
+    for (auto& i : find_centroid_candidates(*index, graph_s)) {
+      if (cluster_sizes[i] == 0)
+        continue; // retired
+      double distance = centroid_distance(graph_s, centroid_sketches[i],
+                                          centroid_projections[i]);
+      if (distance < min_distance) {
+        min_distance = distance;
+        nearest_cluster = i;
+      }
+    }
+    if (nearest_cluster != -1 &&
+        min_distance <= min(anomaly_threshold,
+                            cluster_thresholds[nearest_cluster])) {
+      full_scan = false;
+    } else {
+      min_distance = 5.0;
+      nearest_cluster = -1;
+      index->num_full_scans++;
+    }
+  }
+
+  // calculate distance of graph to all cluster centroids not ruled out
+  uint32_t nclusters = cluster_sizes.size();
 #ifdef DEBUG
   cout << "\tUpdating edge for gid: " << gid << endl;
   cout << "\tDistances: ";
 #endif
-  for (uint32_t i = 0; i < nclusters; i++) {
-    distances[i] = 1.0 -
-      cos(PI*(1.0 - streamhash_similarity(graph_sketches[gid],
-                                          centroid_sketches[i])));
+  if (full_scan) {
+    uint32_t start = cluster_map[gid] >= 0 ? cluster_map[gid] : 0;
+    uint32_t min_hamming = W + 1;
+    for (uint32_t k = 0; k < nclusters; k++) {
+      uint32_t i = k == 0 ? start : (k <= start ? k - 1 : k);
+      if (cluster_sizes[i] == 0)
+        continue; // retired
+      if (bounds.stale[i]) {
+        update_centroid_bounds(bounds, i, centroid_sketches[i],
+                               centroid_projections[i]);
+      }
+      if (nearest_cluster != -1) {
+        // lower bound on the graph's distance to centroid i
+        int bound = bounds.distances[nearest_cluster * bounds.capacity + i] -
+                    static_cast<int>(bounds.drift[nearest_cluster] +
+                                     bounds.drift[i] + min_hamming);
+        if (bound > static_cast<int>(min_hamming) ||
+            (bound == static_cast<int>(min_hamming) &&
+             static_cast<int>(i) > nearest_cluster)) {
+          bounds.num_pruned++;
+          continue;
+        }
+      }
+
+      // centroid i is nearer below limit, ties go to the lowest index
+      uint32_t limit = min_hamming +
+                       (static_cast<int>(i) < nearest_cluster ? 1 : 0);
+      refresh_sketch(centroid_sketches[i], centroid_projections[i]);
+      uint32_t hamming =
+        cascade ? sketch_distance_below(graph_s, centroid_sketches[i], limit)
+                : sketch_distance(graph_s, centroid_sketches[i]);
 #ifdef DEBUG
-    cout << distances[i] << " ";
+      cout << i << ":" << hamming_to_distance<W>(hamming) << " ";
 #endif
-    if (distances[i] < min_distance) {
-      min_distance = distances[i];
-      nearest_cluster = i;
+      if (hamming < limit) {
+        min_hamming = hamming;
+        nearest_cluster = i;
+      }
     }
+    min_distance = hamming_to_distance<W>(min_hamming);
+    bounds.num_distances += nclusters;
   }
 #ifdef DEBUG
   cout << endl;
@@ -138,13 +547,17 @@ void update_distances_and_clusters(uint32_t gid,
 
   // set its anomaly score to distance from nearest centroid
   anomaly_scores[gid] = min_distance;
+  if (calibration != nullptr && nearest_cluster != -1) {
+    record_cluster_distance(*calibration, nearest_cluster, min_distance);
+  }
   int current_cluster = cluster_map[gid];
 #ifdef DEBUG
   cout << "\tCurrent cluster: " << current_cluster << endl;
 #endif
 
-  // if distance > threshold: outlier
-  if (min_distance > min(anomaly_threshold,
+  // if distance > threshold (or all clusters are retired): outlier
+  if (nearest_cluster == -1 ||
+      min_distance > min(anomaly_threshold,
                          cluster_thresholds[nearest_cluster])) {
     // change cluster mapping to ANOMALY
     cluster_map[gid] = ANOMALY;
@@ -155,22 +568,27 @@ void update_distances_and_clusters(uint32_t gid,
       int old_cluster_size = cluster_sizes[current_cluster];
       cluster_sizes[current_cluster]--;
 
-      // update cluster centroid projection/sketch
+      // update cluster centroid projection/sketch, unless it is retired
       auto& centroid_p = centroid_projections[current_cluster];
+      decay_projection(centroid_p, centroid_epochs[current_cluster],
+                       epoch, decay);
       auto& centroid_s = centroid_sketches[current_cluster];
       auto& graph_projection = graph_projections[gid];
-      for (uint32_t l = 0; l < L; l++) {
-        centroid_p[l] = (centroid_p[l] * old_cluster_size -
-                          (graph_projection[l] - projection_delta[l])) /
-                        (old_cluster_size - 1);
-        centroid_s[l] = centroid_p[l] >= 0 ? 1 : 0;
+      if (old_cluster_size > 1) {
+        for (uint32_t l = 0; l < W; l++) {
+          centroid_p[l] = (centroid_p[l] * old_cluster_size -
+                            (graph_projection[l] - projection_delta[l])) /
+                          (old_cluster_size - 1);
+        }
+        centroid_s.dirty = true;
+        centroid_moved(index, bounds, current_cluster, centroid_s,
+                       centroid_p);
       }
 
       // update anomaly score if current cluster == nearest cluster (centroid moved)
       if (current_cluster == nearest_cluster) {
-        anomaly_scores[gid] = 1.0 -
-          cos(PI*(1.0 - streamhash_similarity(graph_sketches[gid],
-                                              centroid_s)));
+        anomaly_scores[gid] =
+          centroid_distance(graph_s, centroid_s, centroid_p);
       }
     }
   } else { // else if distance <= threshold:
@@ -190,6 +608,8 @@ void update_distances_and_clusters(uint32_t gid,
 
         // update cluster centroid projection/sketch
         auto& centroid_p = centroid_projections[current_cluster];
+        decay_projection(centroid_p, centroid_epochs[current_cluster],
+                         epoch, decay);
         auto& centroid_s = centroid_sketches[current_cluster];
         auto& graph_projection = graph_projections[gid];
 
@@ -200,11 +620,15 @@ void update_distances_and_clusters(uint32_t gid,
         cout << endl;
 #endif
 
-        for (uint32_t l = 0; l < L; l++) {
-          centroid_p[l] = (centroid_p[l] * old_cluster_size -
-                            (graph_projection[l] - projection_delta[l])) /
-                          (old_cluster_size - 1);
-          centroid_s[l] = centroid_p[l] >= 0 ? 1 : 0;
+        if (old_cluster_size > 1) {
+          for (uint32_t l = 0; l < W; l++) {
+            centroid_p[l] = (centroid_p[l] * old_cluster_size -
+                              (graph_projection[l] - projection_delta[l])) /
+                            (old_cluster_size - 1);
+          }
+          centroid_s.dirty = true;
+          centroid_moved(index, bounds, current_cluster, centroid_s,
+                         centroid_p);
         }
 
 #ifdef DEBUG
@@ -223,6 +647,8 @@ void update_distances_and_clusters(uint32_t gid,
 
       // update new cluster centroid projection/sketch
       auto& centroid_p = centroid_projections[nearest_cluster];
+      decay_projection(centroid_p, centroid_epochs[nearest_cluster],
+                       epoch, decay);
       auto& centroid_s = centroid_sketches[nearest_cluster];
       auto& graph_projection = graph_projections[gid];
 
@@ -238,16 +664,16 @@ void update_distances_and_clusters(uint32_t gid,
       cout << endl;
 #endif
 
-      for (uint32_t l = 0; l < L; l++) {
+      for (uint32_t l = 0; l < W; l++) {
         centroid_p[l] = (centroid_p[l] * old_cluster_size + graph_projection[l]) /
                         (old_cluster_size + 1);
-        centroid_s[l] = centroid_p[l] >= 0 ? 1 : 0;
       }
+      centroid_s.dirty = true;
+      centroid_moved(index, bounds, nearest_cluster, centroid_s, centroid_p);
 
       // update anomaly score wrt. nearest cluster (centroid moved)
-      anomaly_scores[gid] = 1.0 -
-        cos(PI*(1.0 - streamhash_similarity(graph_sketches[gid],
-                                            centroid_s)));
+      anomaly_scores[gid] =
+        centroid_distance(graph_s, centroid_s, centroid_p);
 
 #ifdef DEBUG
       cout << "\tNew cluster centroid after adding graph: ";
@@ -261,6 +687,8 @@ void update_distances_and_clusters(uint32_t gid,
       // only update the current_cluster centroid using the projection delta
       int current_cluster_size = cluster_sizes[current_cluster];
       auto& centroid_p = centroid_projections[current_cluster];
+      decay_projection(centroid_p, centroid_epochs[current_cluster],
+                       epoch, decay);
       auto& centroid_s = centroid_sketches[current_cluster];
 
 #ifdef DEBUG
@@ -274,16 +702,16 @@ void update_distances_and_clusters(uint32_t gid,
       cout << endl;
 #endif
 
-      for (uint32_t l = 0; l < L; l++) {
+      for (uint32_t l = 0; l < W; l++) {
         centroid_p[l] += static_cast<double>(projection_delta[l]) /
                          current_cluster_size;
-        centroid_s[l] = centroid_p[l] >= 0 ? 1 : 0;
       }
+      centroid_s.dirty = true;
+      centroid_moved(index, bounds, current_cluster, centroid_s, centroid_p);
 
       // update anomaly score wrt. nearest cluster (centroid moved)
-      anomaly_scores[gid] = 1.0 -
-        cos(PI*(1.0 - streamhash_similarity(graph_sketches[gid],
-                                            centroid_s)));
+      anomaly_scores[gid] =
+        centroid_distance(graph_s, centroid_s, centroid_p);
 
 #ifdef DEBUG
       cout << "\tExisting cluster centroid after modifying graph: ";
@@ -295,6 +723,318 @@ void update_distances_and_clusters(uint32_t gid,
 #endif
     }
   }
+
+  return searched;
+}
+
+/* Makes clusters of anomalies lying close together, so that a new behaviour
+ * that persists stops being anomalous. Anomalies are taken as seeds in gid
+ * order, each gathering the anomalies not yet taken within
+ * anomaly_threshold of it. If at least min_graphs of them are within
+ * anomaly_threshold of their mean, they become a cluster with that mean as
+ * its centroid and anomaly_threshold as its threshold.
+ *
+ * A new cluster takes the place of a retired one, or is added while there
+ * are fewer than capacity, for which the per-cluster vectors have room.
+ * Returns the number of clusters made, and appends the graphs moved to
+ * changes.
+ */
+template<uint32_t W>
+uint32_t spawn_clusters(uint32_t min_graphs, uint32_t capacity,
+                        vector<sign_sketch<W>>& graph_sketches,
+                        vector<vector<double>>& graph_projections,
+                        vector<uint32_t>& graph_epochs,
+                        vector<sign_sketch<W>>& centroid_sketches,
+                        vector<vector<double>>& centroid_projections,
+                        vector<uint32_t>& cluster_sizes,
+                        vector<uint32_t>& centroid_epochs,
+                        uint32_t epoch, double decay,
+                        vector<int>& cluster_map,
+                        vector<double>& anomaly_scores,
+                        double anomaly_threshold,
+                        vector<double>& cluster_thresholds,
+                        centroid_index<W>* index,
+                        centroid_bounds<W>& bounds,
+                        threshold_calibration* calibration,
+                        vector<cluster_change>& changes) {
+  vector<uint32_t> anomalies;
+  for (uint32_t gid = 0; gid < cluster_map.size(); gid++) {
+    if (cluster_map[gid] == ANOMALY) {
+      anomalies.push_back(gid);
+      refresh_sketch(graph_sketches[gid], graph_projections[gid]);
+    }
+  }
+  if (anomalies.size() < min_graphs)
+    return 0;
+
+  vector<double> projection(W);
+  auto mean_projection = [&](const vector<uint32_t>& members) {
+    fill(projection.begin(), projection.end(), 0.0);
+    for (auto& gid : members) {
+      decay_projection(graph_projections[gid], graph_epochs[gid], epoch,
+                       decay);
+      for (uint32_t l = 0; l < W; l++) {
+        projection[l] += graph_projections[gid][l];
+      }
+    }
+    for (uint32_t l = 0; l < W; l++) {
+      projection[l] /= members.size();
+    }
+  };
+
+  uint32_t num_spawned = 0;
+  vector<uint8_t> taken(cluster_map.size(), 0);
+  vector<uint32_t> group, members;
+  for (auto& seed : anomalies) {
+    if (taken[seed])
+      continue;
+    group.clear();
+    for (auto& gid : anomalies) {
+      if (!taken[gid] &&
+          hamming_to_distance<W>(sketch_distance(graph_sketches[seed],
+                                                 graph_sketches[gid])) <=
+          anomaly_threshold) {
+        group.push_back(gid);
+      }
+    }
+    if (group.size() < min_graphs)
+      continue;
+
+    // the graphs of the group near its mean
+    mean_projection(group);
+    auto mean_s = make_sign_sketch<W>(projection);
+    members.clear();
+    for (auto& gid : group) {
+      if (hamming_to_distance<W>(sketch_distance(graph_sketches[gid],
+                                                 mean_s)) <=
+          anomaly_threshold) {
+        members.push_back(gid);
+      }
+    }
+    if (members.size() < min_graphs)
+      continue;
+    if (members.size() < group.size()) {
+      mean_projection(members);
+    }
+
+    // the first retired cluster, or a new one
+    uint32_t c = 0;
+    while (c < cluster_sizes.size() && cluster_sizes[c] > 0)
+      c++;
+    if (c == capacity)
+      break;
+    if (c == cluster_sizes.size()) {
+      centroid_projections.push_back(projection);
+      centroid_sketches.push_back(make_sign_sketch<W>(projection));
+      cluster_sizes.push_back(0);
+      centroid_epochs.push_back(epoch);
+      cluster_thresholds.push_back(anomaly_threshold);
+      if (index != nullptr) {
+        index_new_centroid(*index, centroid_sketches[c]);
+      }
+      bounds.snapshots.push_back(centroid_sketches[c]);
+      bounds.drift.push_back(0);
+      bounds.stale.push_back(0);
+      snapshot_distances(bounds, c);
+      if (calibration != nullptr) {
+        calibration->current.emplace_back();
+        calibration->previous.emplace_back();
+      }
+    } else {
+      centroid_projections[c] = projection;
+      centroid_sketches[c].dirty = true;
+      centroid_epochs[c] = epoch;
+      cluster_thresholds[c] = anomaly_threshold;
+      centroid_moved(index, bounds, c, centroid_sketches[c],
+                     centroid_projections[c]);
+    }
+    if (calibration != nullptr) {
+      clear_quantile_sketch(calibration->current[c]);
+      clear_quantile_sketch(calibration->previous[c]);
+    }
+
+    cluster_sizes[c] = members.size();
+    for (auto& gid : members) {
+      changes.push_back(cluster_change{gid, ANOMALY, anomaly_scores[gid]});
+      cluster_map[gid] = c;
+      anomaly_scores[gid] = centroid_distance(graph_sketches[gid],
+                                              centroid_sketches[c],
+                                              centroid_projections[c]);
+      taken[gid] = 1;
+    }
+    num_spawned++;
+  }
+  return num_spawned;
 }
 
+/* Merges clusters whose centroids came within CLUSTER_MERGE_DISTANCE of
+ * each other into the first of them, retiring the other. Pairs are ruled
+ * out with bounds, as in a full search. The merged centroid is the mean of
+ * the graphs of both clusters, and its threshold the larger of theirs.
+ * Returns the number of clusters retired, and appends the graphs of merged
+ * clusters, whose scores changed, to changes.
+ */
+template<uint32_t W>
+uint32_t merge_clusters(vector<sign_sketch<W>>& graph_sketches,
+                        const vector<vector<double>>& graph_projections,
+                        vector<sign_sketch<W>>& centroid_sketches,
+                        vector<vector<double>>& centroid_projections,
+                        vector<uint32_t>& cluster_sizes,
+                        vector<uint32_t>& centroid_epochs,
+                        uint32_t epoch, double decay,
+                        vector<int>& cluster_map,
+                        vector<double>& anomaly_scores,
+                        vector<double>& cluster_thresholds,
+                        centroid_index<W>* index,
+                        centroid_bounds<W>& bounds,
+                        vector<cluster_change>& changes) {
+  uint32_t nclusters = cluster_sizes.size();
+  for (uint32_t c = 0; c < nclusters; c++) {
+    if (cluster_sizes[c] > 0 && bounds.stale[c]) {
+      update_centroid_bounds(bounds, c, centroid_sketches[c],
+                             centroid_projections[c]);
+    }
+  }
+
+  uint32_t num_merged = 0;
+  for (uint32_t i = 0; i < nclusters; i++) {
+    if (cluster_sizes[i] == 0)
+      continue;
+    for (uint32_t j = i + 1; j < nclusters; j++) {
+      if (cluster_sizes[j] == 0)
+        continue;
+      int bound = bounds.distances[i * bounds.capacity + j] -
+                  static_cast<int>(bounds.drift[i] + bounds.drift[j]);
+      if (bound > 0 && hamming_to_distance<W>(bound) > CLUSTER_MERGE_DISTANCE)
+        continue;
+      refresh_sketch(centroid_sketches[i], centroid_projections[i]);
+      if (centroid_distance(centroid_sketches[i], centroid_sketches[j],
+                            centroid_projections[j]) > CLUSTER_MERGE_DISTANCE)
+        continue;
+
+      auto& centroid_p = centroid_projections[i];
+      auto& merged_p = centroid_projections[j];
+      decay_projection(centroid_p, centroid_epochs[i], epoch, decay);
+      decay_projection(merged_p, centroid_epochs[j], epoch, decay);
+      double size = cluster_sizes[i];
+      double merged_size = cluster_sizes[j];
+      for (uint32_t l = 0; l < W; l++) {
+        centroid_p[l] = (centroid_p[l] * size + merged_p[l] * merged_size) /
+                        (size + merged_size);
+      }
+      cluster_sizes[i] += cluster_sizes[j];
+      cluster_sizes[j] = 0;
+      cluster_thresholds[i] = max(cluster_thresholds[i], cluster_thresholds[j]);
+      centroid_sketches[i].dirty = true;
+      centroid_moved(index, bounds, i, centroid_sketches[i], centroid_p);
+      update_centroid_bounds(bounds, i, centroid_sketches[i], centroid_p);
+
+      for (uint32_t gid = 0; gid < cluster_map.size(); gid++) {
+        if (cluster_map[gid] != static_cast<int>(i) &&
+            cluster_map[gid] != static_cast<int>(j))
+          continue;
+        changes.push_back(cluster_change{gid, cluster_map[gid],
+                                         anomaly_scores[gid]});
+        cluster_map[gid] = i;
+        anomaly_scores[gid] =
+          centroid_distance(refresh_sketch(graph_sketches[gid],
+                                           graph_projections[gid]),
+                            centroid_sketches[i], centroid_p);
+      }
+      num_merged++;
+    }
+  }
+  return num_merged;
+}
+
+/* Decides whether a graph's nearest centroid should be searched for at this
+ * update. A graph that stays in its cluster while its sketch drifts from the
+ * last searched sketch by at most max_drift bits is searched half as often
+ * each time, up to once every max_interval updates. A larger drift brings it
+ * back to every update.
+ */
+template<uint32_t W>
+bool schedule_cluster_check(const sign_sketch<W>& sketch,
+                            cluster_schedule<W>& schedule,
+                            uint32_t max_interval, uint32_t max_drift) {
+  if (max_interval <= 1)
+    return true;
+
+  uint32_t drift = sketch_distance(sketch, schedule.checked_sketch);
+  if (schedule.countdown > 0 && drift <= max_drift) {
+    schedule.countdown--;
+    return false;
+  }
+
+  if (drift <= max_drift) {
+    schedule.interval = min(2 * schedule.interval, max_interval);
+  } else {
+    schedule.interval = 1;
+  }
+  schedule.checked_sketch = sketch;
+  schedule.countdown = schedule.interval - 1;
+  return true;
+}
+
+// Restarts the schedule after a full search moved the graph to a new cluster.
+template<uint32_t W>
+void reset_cluster_schedule(cluster_schedule<W>& schedule) {
+  schedule.interval = 1;
+  schedule.countdown = 0;
+}
+
+#define INSTANTIATE_CLUSTER(W) \
+  template tuple<vector<sign_sketch<W>>, vector<vector<double>>> \
+    construct_centroid_sketches<W>( \
+      const vector<vector<double>>& streamhash_projections, \
+      const vector<vector<uint32_t>>& clusters, uint32_t nclusters, \
+      thread_pool& pool); \
+  template bool update_distances_and_clusters<W>( \
+    uint32_t gid, const vector<int>& projection_delta, \
+    vector<sign_sketch<W>>& graph_sketches, \
+    const vector<vector<double>>& graph_projections, \
+    vector<sign_sketch<W>>& centroid_sketches, \
+    vector<vector<double>>& centroid_projections, \
+    vector<uint32_t>& cluster_sizes, vector<uint32_t>& centroid_epochs, \
+    uint32_t epoch, double decay, vector<int>& cluster_map, \
+    vector<double>& anomaly_scores, double anomaly_threshold, \
+    const vector<double>& cluster_thresholds, bool search_centroids, \
+    bool cascade, centroid_index<W>* index, centroid_bounds<W>& bounds, \
+    threshold_calibration* calibration); \
+  template uint32_t spawn_clusters<W>( \
+    uint32_t min_graphs, uint32_t capacity, \
+    vector<sign_sketch<W>>& graph_sketches, \
+    vector<vector<double>>& graph_projections, \
+    vector<uint32_t>& graph_epochs, \
+    vector<sign_sketch<W>>& centroid_sketches, \
+    vector<vector<double>>& centroid_projections, \
+    vector<uint32_t>& cluster_sizes, vector<uint32_t>& centroid_epochs, \
+    uint32_t epoch, double decay, vector<int>& cluster_map, \
+    vector<double>& anomaly_scores, double anomaly_threshold, \
+    vector<double>& cluster_thresholds, centroid_index<W>* index, \
+    centroid_bounds<W>& bounds, threshold_calibration* calibration, \
+    vector<cluster_change>& changes); \
+  template uint32_t merge_clusters<W>( \
+    vector<sign_sketch<W>>& graph_sketches, \
+    const vector<vector<double>>& graph_projections, \
+    vector<sign_sketch<W>>& centroid_sketches, \
+    vector<vector<double>>& centroid_projections, \
+    vector<uint32_t>& cluster_sizes, vector<uint32_t>& centroid_epochs, \
+    uint32_t epoch, double decay, vector<int>& cluster_map, \
+    vector<double>& anomaly_scores, vector<double>& cluster_thresholds, \
+    centroid_index<W>* index, centroid_bounds<W>& bounds, \
+    vector<cluster_change>& changes); \
+  template void build_centroid_bounds<W>( \
+    centroid_bounds<W>& bounds, vector<sign_sketch<W>>& centroid_sketches, \
+    const vector<vector<double>>& centroid_projections, uint32_t capacity); \
+  template void build_centroid_index<W>( \
+    centroid_index<W>& index, vector<sign_sketch<W>>& centroid_sketches, \
+    const vector<vector<double>>& centroid_projections, uint32_t capacity); \
+  template bool schedule_cluster_check<W>(const sign_sketch<W>& sketch, \
+                                          cluster_schedule<W>& schedule, \
+                                          uint32_t max_interval, \
+                                          uint32_t max_drift); \
+  template void reset_cluster_schedule<W>(cluster_schedule<W>& schedule);
+FOR_EACH_SKETCH_WIDTH(INSTANTIATE_CLUSTER)
+
 }
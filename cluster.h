@@ -10,6 +10,9 @@
 #include <bitset>
 #include "cluster.h"
 #include "param.h"
+#include "quantile.h"
+#include "streamhash.h"
+#include "thread_pool.h"
 #include <tuple>
 #include <unordered_map>
 #include <unordered_set>
@@ -20,30 +23,213 @@
 
 namespace std {
 
-void hash_bands(uint32_t gid, const bitset<L>& sketch,
-                vector<unordered_map<bitset<R>,vector<uint32_t>>>& hash_tables);
-bool is_isolated(const bitset<L>& sketch,
-                 const vector<unordered_map<bitset<R>,vector<uint32_t>>>&
-                    hash_tables);
-void get_shared_bucket_graphs(const bitset<L>& sketch,
-                              const vector<unordered_map<bitset<R>,
-                                                   vector<uint32_t>>>& hash_tables,
+// per-graph state of schedule_cluster_check
+template<uint32_t W>
+struct cluster_schedule {
+  sign_sketch<W> checked_sketch; // sketch at the last centroid search
+  uint32_t interval;             // updates between centroid searches
+  uint32_t countdown;            // updates to skip before the next search
+  cluster_schedule() : checked_sketch(), interval(1), countdown(0) {}
+};
+
+#define NO_BAND_ENTRY 0xffffffffu
+
+static_assert(R <= 32, "bands are extracted into 32-bit words");
+
+// slot of a band_table, head is NO_BAND_ENTRY if the slot is free
+struct band_slot {
+  uint32_t band;
+  uint32_t head;                           // first and last entry of the
+  uint32_t tail;                           // bucket of this band value
+};
+
+// graph (or cluster) in a bucket of a band_table, next is NO_BAND_ENTRY for
+// the last entry of a bucket or of the free list
+struct band_entry {
+  uint32_t gid;
+  uint32_t next;
+};
+
+/* LSH hash table of one band: graphs by the value of their R-bit band.
+ *
+ * Band values are keys of a flat open-addressing map with linear probing,
+ * kept at most half full. Each slot holds a bucket, a list of graphs in
+ * insertion order, whose entries share one array so that adding a graph
+ * does not allocate, and entries of removed graphs are reused.
+ *
+ * Table i of a vector of tables holds band i, bits [R * i, R * (i + 1)) of
+ * the sketches, which are 0 past the end of a sketch.
+ */
+struct band_table {
+  vector<band_slot> slots;                 // power-of-two size
+  vector<band_entry> entries;
+  uint32_t num_buckets = 0;
+  uint32_t free_entries = NO_BAND_ENTRY;   // list of unused entries
+};
+
+/* LSH index of the centroid sketches, with one band_table per
+ * CENTROID_BAND_BITS-bit band of the sketch. A graph's candidate clusters
+ * are those sharing a band with it. Each centroid is indexed by the bands of
+ * indexed[c], which reindex_centroid brings up to date when it moves.
+ */
+template<uint32_t W>
+struct centroid_index {
+  vector<band_table> tables;
+  vector<sign_sketch<W>> indexed;          // centroid sketches as indexed
+  vector<uint32_t> candidates;             // of the last search
+  vector<uint32_t> marks;                  // search that last found each
+  uint32_t search;                         // cluster, to deduplicate them
+  uint64_t num_searches;
+  uint64_t num_candidates;                 // over all searches
+  uint64_t num_full_scans;                 // searches that fell back
+};
+
+/* Pairwise Hamming distances between centroid sketches, to rule out
+ * centroids in a search with the triangle inequality.
+ *
+ * distances holds the distances between snapshots of the centroid sketches,
+ * and drift each centroid's distance from its snapshot, so the distance
+ * between centroids i and j is at least distances[i][j] - drift[i] -
+ * drift[j]. Drift is only brought up to date for the centroids that moved
+ * (are stale) when a search needs it, and a centroid that drifted over
+ * W / CENTROID_DRIFT_FRACTION bits has its snapshot and distances
+ * recomputed.
+ */
+template<uint32_t W>
+struct centroid_bounds {
+  uint32_t capacity;                       // clusters it can hold
+  vector<sign_sketch<W>> snapshots;
+  vector<uint16_t> distances;              // capacity x capacity
+  vector<uint32_t> drift;
+  vector<uint8_t> stale;                   // moved since drift was computed
+  uint64_t num_distances;                  // centroids in full searches
+  uint64_t num_pruned;                     // of which ruled out
+};
+
+// a graph moved to another cluster by spawn_clusters or merge_clusters
+struct cluster_change {
+  uint32_t gid;
+  int previous_cluster;
+  double previous_score;
+};
+
+// Band i of a sketch of num_words words, bits [r * i, r * (i + 1)) with bit
+// r * i lowest, where bits past the sketch are 0. A band spans at most two
+// words, and the second word's bits are masked off if it fits in the first,
+// so the words are combined with selects rather than branches.
+inline uint32_t sketch_band(const uint64_t* words, uint32_t num_words,
+                            uint32_t i, uint32_t r = R) {
+  uint32_t first_bit = r * i;
+  uint32_t w = first_bit / 64;
+  uint32_t shift = first_bit % 64;
+  uint64_t word = w < num_words ? words[w] : 0;
+  uint64_t next = w + 1 < num_words ? words[w + 1] : 0;
+  uint64_t bits = (word >> shift) | ((next << 1) << (63 - shift));
+  return static_cast<uint32_t>(bits & ((1ull << r) - 1));
+}
+
+inline uint32_t band_slot_index(uint32_t band, uint32_t mask) {
+  uint32_t h = band * 2654435761u; // Knuth's multiplicative hash
+  return (h ^ (h >> 16)) & mask;   // with the high bits folded into the slot
+}
+
+// First entry of the bucket of graphs whose band has this value, followed by
+// band_entry::next, or NO_BAND_ENTRY if there are none.
+inline uint32_t find_band_bucket(const band_table& table, uint32_t band) {
+  if (table.slots.empty())
+    return NO_BAND_ENTRY;
+  uint32_t mask = table.slots.size() - 1;
+  for (uint32_t s = band_slot_index(band, mask); ; s = (s + 1) & mask) {
+    auto& slot = table.slots[s];
+    if (slot.head == NO_BAND_ENTRY || slot.band == band)
+      return slot.head;
+  }
+}
+
+void reserve_band_table(band_table& table, uint32_t num_entries);
+void insert_band_entry(band_table& table, uint32_t band, uint32_t gid);
+void erase_band_entry(band_table& table, uint32_t band, uint32_t gid);
+void hash_bands(uint32_t gid, const uint64_t* sketch_words,
+                uint32_t num_words, vector<band_table>& hash_tables);
+bool is_isolated(const uint64_t* sketch_words, uint32_t num_words,
+                 const vector<band_table>& hash_tables);
+void get_shared_bucket_graphs(const uint64_t* sketch_words,
+                              uint32_t num_words,
+                              const vector<band_table>& hash_tables,
                               unordered_set<uint32_t>& shared_bucket_graphs);
-tuple<vector<bitset<L>>, vector<vector<double>>>
-construct_centroid_sketches(const vector<vector<int>>& streamhash_projections,
+
+// W is the sketch width, see streamhash.h
+template<uint32_t W>
+tuple<vector<sign_sketch<W>>, vector<vector<double>>>
+construct_centroid_sketches(const vector<vector<double>>& streamhash_projections,
                             const vector<vector<uint32_t>>& bootstrap_clusters,
-                            uint32_t nclusters);
-void update_distances_and_clusters(uint32_t gid,
+                            uint32_t nclusters, thread_pool& pool);
+template<uint32_t W>
+void build_centroid_index(centroid_index<W>& index,
+                          vector<sign_sketch<W>>& centroid_sketches,
+                          const vector<vector<double>>& centroid_projections,
+                          uint32_t capacity);
+template<uint32_t W>
+void build_centroid_bounds(centroid_bounds<W>& bounds,
+                           vector<sign_sketch<W>>& centroid_sketches,
+                           const vector<vector<double>>& centroid_projections,
+                           uint32_t capacity);
+template<uint32_t W>
+bool update_distances_and_clusters(uint32_t gid,
                                    const vector<int>& projection_delta,
-                                   const vector<bitset<L>>& graph_sketches,
-                                   const vector<vector<int>>& graph_projections,
-                                   vector<bitset<L>>& centroid_sketches,
+                                   vector<sign_sketch<W>>& graph_sketches,
+                                   const vector<vector<double>>& graph_projections,
+                                   vector<sign_sketch<W>>& centroid_sketches,
                                    vector<vector<double>>& centroid_projections,
                                    vector<uint32_t>& cluster_sizes,
+                                   vector<uint32_t>& centroid_epochs,
+                                   uint32_t epoch, double decay,
                                    vector<int>& cluster_map,
                                    vector<double>& anomaly_scores,
                                    double anomaly_threshold,
-                                   const vector<double>& cluster_thresholds);
+                                   const vector<double>& cluster_thresholds,
+                                   bool search_centroids, bool cascade,
+                                   centroid_index<W>* index,
+                                   centroid_bounds<W>& bounds,
+                                   threshold_calibration* calibration);
+template<uint32_t W>
+uint32_t spawn_clusters(uint32_t min_graphs, uint32_t capacity,
+                        vector<sign_sketch<W>>& graph_sketches,
+                        vector<vector<double>>& graph_projections,
+                        vector<uint32_t>& graph_epochs,
+                        vector<sign_sketch<W>>& centroid_sketches,
+                        vector<vector<double>>& centroid_projections,
+                        vector<uint32_t>& cluster_sizes,
+                        vector<uint32_t>& centroid_epochs,
+                        uint32_t epoch, double decay,
+                        vector<int>& cluster_map,
+                        vector<double>& anomaly_scores,
+                        double anomaly_threshold,
+                        vector<double>& cluster_thresholds,
+                        centroid_index<W>* index,
+                        centroid_bounds<W>& bounds,
+                        threshold_calibration* calibration,
+                        vector<cluster_change>& changes);
+template<uint32_t W>
+uint32_t merge_clusters(vector<sign_sketch<W>>& graph_sketches,
+                        const vector<vector<double>>& graph_projections,
+                        vector<sign_sketch<W>>& centroid_sketches,
+                        vector<vector<double>>& centroid_projections,
+                        vector<uint32_t>& cluster_sizes,
+                        vector<uint32_t>& centroid_epochs,
+                        uint32_t epoch, double decay,
+                        vector<int>& cluster_map,
+                        vector<double>& anomaly_scores,
+                        vector<double>& cluster_thresholds,
+                        centroid_index<W>* index,
+                        centroid_bounds<W>& bounds,
+                        vector<cluster_change>& changes);
+template<uint32_t W>
+bool schedule_cluster_check(const sign_sketch<W>& sketch,
+                            cluster_schedule<W>& schedule,
+                            uint32_t max_interval, uint32_t max_drift);
+template<uint32_t W>
+void reset_cluster_schedule(cluster_schedule<W>& schedule);
 
 }
 
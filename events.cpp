@@ -0,0 +1,166 @@
+/*
+ * Copyright 2016 Emaad Ahmed Manzoor
+ * License: Apache License, Version 2.0
+ * http://www3.cs.stonybrook.edu/~emanzoor/streamspot/
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include "cluster.h"
+#include <condition_variable>
+#include "events.h"
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+namespace std {
+
+event_queue::event_queue(uint32_t capacity)
+  : head(0), tail(0), sleeping(false) {
+  uint64_t size = 1;
+  while (size < capacity) {
+    size *= 2;
+  }
+  slots.resize(size);
+  mask = size - 1;
+}
+
+bool event_queue::push(const anomaly_event& event) {
+  uint64_t t = tail.load(memory_order_relaxed);
+  if (t - head.load(memory_order_acquire) == slots.size())
+    return false;
+  slots[t & mask] = event;
+  // sequentially consistent with sleeping, see wait
+  tail.store(t + 1);
+  if (sleeping.load()) {
+    wake();
+  }
+  return true;
+}
+
+bool event_queue::pop(anomaly_event& event) {
+  uint64_t h = head.load(memory_order_relaxed);
+  if (h == tail.load(memory_order_acquire))
+    return false;
+  event = slots[h & mask];
+  head.store(h + 1, memory_order_release);
+  return true;
+}
+
+// Either push sees sleeping set and wakes the consumer, or the consumer
+// sees the pushed event before sleeping. The mutex is held from the last
+// check until cv.wait releases it, so the wake-up cannot come in between.
+void event_queue::wait(const atomic<bool>& stop) {
+  unique_lock<mutex> lock(m);
+  sleeping.store(true);
+  cv.wait(lock, [&]{
+    return stop || tail.load() != head.load(memory_order_relaxed);
+  });
+  sleeping.store(false);
+}
+
+void event_queue::wake() {
+  lock_guard<mutex> lock(m);
+  cv.notify_one();
+}
+
+event_writer::event_writer(event_queue& queue, ostream& out)
+  : num_written(0), total_latency(0), max_latency(0), queue(queue),
+    out(out), stopping(false) {
+  writer = thread(&event_writer::writer_loop, this);
+}
+
+event_writer::~event_writer() {
+  stop();
+}
+
+void event_writer::stop() {
+  stopping = true;
+  queue.wake();
+  if (writer.joinable()) {
+    writer.join();
+  }
+}
+
+void event_writer::writer_loop() {
+  anomaly_event event;
+  while (true) {
+    // read stopping first, so no event pushed before stop is missed
+    bool last = stopping;
+    bool wrote = false;
+    while (queue.pop(event)) {
+      write(event);
+      wrote = true;
+    }
+    if (wrote) {
+      out.flush();
+    }
+    if (last)
+      return;
+    if (!wrote) {
+      queue.wait(stopping);
+    }
+  }
+}
+
+void event_writer::write(const anomaly_event& event) {
+  auto latency = chrono::duration_cast<chrono::nanoseconds>(
+    chrono::steady_clock::now() - event.arrival);
+  total_latency += latency;
+  max_latency = max(max_latency, latency);
+  num_written++;
+
+  out << event.edge_num << "\t" << event.gid << "\t";
+  out << anomaly_event_name(event.kind) << "\t" << event.cluster << "\t";
+  out << event.score << "\n";
+}
+
+const char* anomaly_event_name(anomaly_event_kind kind) {
+  switch (kind) {
+    case EVENT_ANOMALY: return "anomaly";
+    case EVENT_ABOVE:   return "above";
+    default:            return "below";
+  }
+}
+
+/* Fires the events of a graph's update from previous_cluster and
+ * previous_score: becoming an anomaly, and crossing the threshold either
+ * way. Callbacks run on the calling thread, before the event is queued.
+ */
+void fire_anomaly_events(anomaly_monitor& monitor, uint32_t gid,
+                         uint32_t edge_num, int previous_cluster, int cluster,
+                         double previous_score, double score,
+                         chrono::steady_clock::time_point arrival) {
+  anomaly_event event;
+  event.gid = gid;
+  event.edge_num = edge_num;
+  event.cluster = cluster;
+  event.score = score;
+  event.arrival = arrival;
+
+  auto fire = [&](anomaly_event_kind kind) {
+    event.kind = kind;
+    monitor.num_events++;
+    for (auto& callback : monitor.callbacks) {
+      callback(event);
+    }
+    if (monitor.queue != nullptr && !monitor.queue->push(event)) {
+      monitor.num_dropped++;
+    }
+  };
+
+  if (cluster == ANOMALY && previous_cluster != ANOMALY) {
+    fire(EVENT_ANOMALY);
+  }
+  if (score > monitor.threshold && !(previous_score > monitor.threshold)) {
+    fire(EVENT_ABOVE);
+  } else if (!(score > monitor.threshold) &&
+             previous_score > monitor.threshold) {
+    fire(EVENT_BELOW);
+  }
+}
+
+}
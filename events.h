@@ -0,0 +1,108 @@
+/*
+ * Copyright 2016 Emaad Ahmed Manzoor
+ * License: Apache License, Version 2.0
+ * http://www3.cs.stonybrook.edu/~emanzoor/streamspot/
+ */
+
+#ifndef STREAMSPOT_EVENTS_H_
+#define STREAMSPOT_EVENTS_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+namespace std {
+
+enum anomaly_event_kind {
+  EVENT_ANOMALY,     // the graph's cluster became ANOMALY
+  EVENT_ABOVE,       // its score rose above the alert threshold
+  EVENT_BELOW        // its score fell back to the threshold or below
+};
+
+struct anomaly_event {
+  anomaly_event_kind kind;
+  uint32_t gid;
+  uint32_t edge_num;                       // edge whose update fired it
+  int cluster;                             // after the update
+  double score;                            // after the update
+  chrono::steady_clock::time_point arrival; // of the edge
+};
+
+typedef function<void(const anomaly_event&)> anomaly_callback;
+
+/* Bounded lock-free queue of events between one producer and one consumer
+ * thread. Each side only writes its own index, and publishes it with a
+ * release store that the other side reads with an acquire load.
+ *
+ * An idle consumer sleeps in wait rather than polling. The producer only
+ * takes the mutex to wake it up when it is sleeping, which the consumer
+ * announces with sleeping before it checks the queue a last time.
+ */
+class event_queue {
+ public:
+  explicit event_queue(uint32_t capacity); // rounded up to a power of 2
+
+  bool push(const anomaly_event& event);   // false if full
+  bool pop(anomaly_event& event);          // false if empty
+  void wait(const atomic<bool>& stop);     // until not empty or stop
+  void wake();                             // after setting a wait's stop
+
+ private:
+  vector<anomaly_event> slots;
+  uint64_t mask;
+  atomic<uint64_t> head;                   // next to pop, by the consumer
+  char padding[64];                        // keeps head and tail apart
+  atomic<uint64_t> tail;                   // next to push, by the producer
+  atomic<bool> sleeping;                   // the consumer is in wait
+  mutex m;
+  condition_variable cv;
+};
+
+/* Writes the events of a queue to out on its own thread, one line each, and
+ * measures the latency from the arrival of their edge to their writing.
+ * Stopping writes the events left.
+ */
+class event_writer {
+ public:
+  event_writer(event_queue& queue, ostream& out);
+  ~event_writer();
+
+  void stop();
+
+  uint64_t num_written;                    // valid after stop
+  chrono::nanoseconds total_latency;
+  chrono::nanoseconds max_latency;
+
+ private:
+  void writer_loop();
+  void write(const anomaly_event& event);
+
+  event_queue& queue;
+  ostream& out;
+  atomic<bool> stopping;
+  thread writer;
+};
+
+// where the events of a run go, see fire_anomaly_events
+struct anomaly_monitor {
+  double threshold;                        // alert score
+  vector<anomaly_callback> callbacks;      // called in order
+  event_queue* queue;                      // nullptr for none
+  uint64_t num_events;
+  uint64_t num_dropped;                    // the queue was full
+};
+
+const char* anomaly_event_name(anomaly_event_kind kind);
+void fire_anomaly_events(anomaly_monitor& monitor, uint32_t gid,
+                         uint32_t edge_num, int previous_cluster, int cluster,
+                         double previous_score, double score,
+                         chrono::steady_clock::time_point arrival);
+
+}
+
+#endif
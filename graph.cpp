@@ -8,12 +8,13 @@
 #include <bitset>
 #include <cassert>
 #include <chrono>
+#include "chunk.h"
 #include <cmath>
 #include "graph.h"
 #include "hash.h"
 #include <iostream>
+#include <iterator>
 #include "param.h"
-#include <queue>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
@@ -77,55 +78,52 @@ void remove_from_graph(edge& e, vector<graph>& graphs) {
   }
 }
 
-unordered_map<string,uint32_t>
-  construct_temp_shingle_vector(const graph& g, uint32_t chunk_length) {
-  unordered_map<string,uint32_t> temp_shingle_vector;
+void update_reverse_graphs(const edge& e, vector<reverse_graph>& reverse_graphs) {
+  auto& gid = get<F_GID>(e);
+  auto src = make_pair(get<F_S>(e), get<F_STYPE>(e));
+  auto dst = make_pair(get<F_D>(e), get<F_DTYPE>(e));
+
+  // count the edges from src into dst
+  reverse_graphs[gid][dst][src]++;
+}
+
+void remove_from_reverse_graph(const edge& e,
+                               vector<reverse_graph>& reverse_graphs) {
+  auto& rg = reverse_graphs[get<F_GID>(e)];
+  auto src = make_pair(get<F_S>(e), get<F_STYPE>(e));
+  auto dst = make_pair(get<F_D>(e), get<F_DTYPE>(e));
+
+  auto& in_nodes = rg.at(dst);
+  if (--in_nodes.at(src) == 0) {
+    in_nodes.erase(src);
+    if (in_nodes.empty()) {
+      rg.erase(dst);
+    }
+  }
+}
+
+unordered_map<chunk_key,uint32_t>
+  construct_temp_shingle_vector(const graph& g, uint32_t chunk_length,
+                                chunking_mode chunking) {
+  static thread_local shingle_scratch scratch;
+
+  unordered_map<chunk_key,uint32_t> temp_shingle_vector;
   for (auto& kv : g) {
 #ifdef VERBOSE
       cout << "OkBFT from " << kv.first.first << " " << kv.first.second;
       cout << " (K = " << K << ")";
       cout << " fanout = " << kv.second.size() << endl;
 #endif
-    string shingle; // shingle from this source node
-    queue<tuple<uint32_t,char,char>> q; // (nodeid, nodetype, edgetype)
-    unordered_map<uint32_t,uint32_t> d;
-
-    q.push(make_tuple(kv.first.first, kv.first.second, ' '));
-    d[kv.first.first] = 0;
-
-    while (!q.empty()) {
-      auto& node = q.front();
-      auto& uid = get<0>(node);
-      auto& utype = get<1>(node);
-      auto& etype = get<2>(node);
-      q.pop();
-
-      // use destination and edge types to construct shingle
-      shingle += etype;
-      shingle += utype;
-
-      if (d[uid] == K) { // node is K hops away from src_id
-        continue;        // don't follow its edges
-      }
-
-      // outgoing edges are already sorted by timestamp
-      for (auto& e : g.at(make_pair(uid, utype))) {
-        auto& vid = get<0>(e);
-        d[vid] = d[uid] + 1;
-        q.push(e);
-      }
-    }
+    construct_k_hop_shingle(g, kv.first, K, scratch);
 
     // split shingle into chunks and increment frequency
-    for (auto& chunk : get_string_chunks(shingle, chunk_length)) {
-      temp_shingle_vector[chunk]++;
-    }
+    count_chunks(scratch, chunk_length, chunking, temp_shingle_vector);
   }
 
 #ifdef DEBUG
   cout << "Shingles in graph:" << endl;
   for (auto& kv : temp_shingle_vector) {
-    cout << kv.first << " => " << kv.second << endl;
+    cout << chunk_string(kv.first) << " => " << kv.second << endl;
   }
 #endif
 
@@ -133,11 +131,14 @@ unordered_map<string,uint32_t>
 }
 
 void construct_shingle_vectors(vector<shingle_vector>& shingle_vectors,
-                               unordered_map<string,uint32_t>& shingle_id,
-                               vector<graph>& graphs, uint32_t chunk_length) {
+                               unordered_map<chunk_key,uint32_t>& shingle_id,
+                               vector<graph>& graphs, uint32_t chunk_length,
+                               chunking_mode chunking) {
+
+  static thread_local shingle_scratch scratch;
 
-  unordered_set<string> unique_shingles;
-  vector<unordered_map<string,uint32_t>> temp_shingle_vectors(graphs.size());
+  unordered_set<chunk_key> unique_shingles;
+  vector<unordered_map<chunk_key,uint32_t>> temp_shingle_vectors(graphs.size());
 
   // construct a temporary shingle vector for each graph
   for (uint32_t i = 0; i < graphs.size(); i++) {
@@ -150,52 +151,18 @@ void construct_shingle_vectors(vector<shingle_vector>& shingle_vectors,
       cout << " fanout = " << kv.second.size() << endl;
 #endif
 
-      string shingle; // shingle from this source node
-      queue<tuple<uint32_t,char,char>> q; // (nodeid, nodetype, edgetype)
-      unordered_map<uint32_t,uint32_t> d;
-
-      q.push(make_tuple(kv.first.first, kv.first.second, ' '));
-      d[kv.first.first] = 0;
-
-      while (!q.empty()) {
-        auto& node = q.front();
-        auto& uid = get<0>(node);
-        auto& utype = get<1>(node);
-        auto& etype = get<2>(node);
-        q.pop();
-
-#ifdef VERBOSE
-        cout << "\tPopped (" << uid << ", " << utype << ", " << etype << ")\n";
-#endif
-        // use destination and edge types to construct shingle
-        shingle += etype;
-        shingle += utype;
-
-        if (d[uid] == K) { // node is K hops away from src_id
-#ifdef VERBOSE
-          cout << "Hop limit reached\n";
-#endif
-          continue;        // don't follow its edges
-        }
-
-        // outgoing edges are already sorted by timestamp
-        for (auto& e : graphs[i][make_pair(uid, utype)]) {
-          auto& vid = get<0>(e);
-          d[vid] = d[uid] + 1;
-          q.push(e);
-        }
-      }
+      construct_k_hop_shingle(graphs[i], kv.first, K, scratch);
 
       // split shingle into chunks and increment frequency
-      for (auto& chunk : get_string_chunks(shingle, chunk_length)) {
-        temp_shingle_vectors[i][chunk]++;
-        unique_shingles.insert(chunk);
-      }
+      count_chunks(scratch, chunk_length, chunking, temp_shingle_vectors[i]);
+    }
+    for (auto& kv : temp_shingle_vectors[i]) {
+      unique_shingles.insert(kv.first);
     }
 #ifdef DEBUG
     cout << "Shingles in graph " << i << ":\n";
     for (auto& kv : temp_shingle_vectors[i]) {
-      cout << "\t" << kv.first << " => " << kv.second << endl;
+      cout << "\t" << chunk_string(kv.first) << " => " << kv.second << endl;
     }
 #endif
   }
@@ -210,7 +177,7 @@ void construct_shingle_vectors(vector<shingle_vector>& shingle_vectors,
 #ifdef DEBUG
   cout << "Shingle ID's\n";
   for (auto& kv : shingle_id) {
-    cout << "\t" << kv.first << " => " << kv.second << endl;
+    cout << "\t" << chunk_string(kv.first) << " => " << kv.second << endl;
   }
 #endif
 
@@ -236,7 +203,342 @@ void construct_shingle_vectors(vector<shingle_vector>& shingle_vectors,
 #endif
 }
 
-// FIXME: This is currently tailored for K=1
+// OkBFT from src up to hops hops into scratch.shingle: " " + src_type, then
+// (edge_type, node_type) for every node in breadth-first order. Outgoing
+// edges are followed in timestamp order. If excluded_node is given, its edge
+// at excluded_index is skipped, giving the shingle before that edge was
+// added or after it is removed.
+//
+// Each queue entry carries its own hop count, so no visited/distance map is
+// needed, and the flat queue and shingle keep their capacity across calls.
+void construct_k_hop_shingle(const graph& g, const pair<uint32_t,char>& src,
+                             uint32_t hops, shingle_scratch& scratch,
+                             const pair<uint32_t,char>* excluded_node,
+                             uint32_t excluded_index) {
+  string& shingle = scratch.shingle; // shingle from this source node
+  auto& q = scratch.queue;           // (nodeid, nodetype, edgetype,
+                                     //  hops from src)
+  shingle.clear();
+  q.clear();
+  q.push_back(make_tuple(src.first, src.second, ' ', 0));
+
+  for (uint32_t head = 0; head < q.size(); head++) {
+    auto node = q[head]; // copied, pushes may reallocate the queue
+    auto u = make_pair(get<0>(node), get<1>(node));
+    auto& etype = get<2>(node);
+    auto& d = get<3>(node);
+
+#ifdef VERBOSE
+    cout << "\tPopped (" << u.first << ", " << u.second << ", " << etype << ")\n";
+#endif
+    // use destination and edge types to construct shingle
+    shingle += etype;
+    shingle += u.second;
+
+    if (d == hops) { // node is K hops away from src
+      continue;      // don't follow its edges
+    }
+
+    auto it = g.find(u);
+    if (it == g.end()) { // no outgoing edges
+      continue;
+    }
+
+    // outgoing edges are already sorted by timestamp
+    auto& out_edges = it->second;
+    for (uint32_t i = 0; i < out_edges.size(); i++) {
+      if (excluded_node != nullptr && u == *excluded_node &&
+          i == excluded_index) {
+        continue;
+      }
+      q.push_back(make_tuple(get<0>(out_edges[i]), get<1>(out_edges[i]),
+                             get<2>(out_edges[i]), d + 1));
+    }
+  }
+}
+
+string construct_k_hop_shingle(const graph& g, const pair<uint32_t,char>& src,
+                               uint32_t hops,
+                               const pair<uint32_t,char>* excluded_node,
+                               uint32_t excluded_index) {
+  static thread_local shingle_scratch scratch;
+  construct_k_hop_shingle(g, src, hops, scratch, excluded_node,
+                          excluded_index);
+  return scratch.shingle;
+}
+
+// Calls f on each fixed-length chunk of s. For C > 0 (see
+// DISPATCH_CHUNK_LENGTH), chunks of exactly C characters are packed with an
+// unrolled loop if they fit inline.
+template<uint32_t C, typename F>
+static void for_each_fixed_chunk(const string& s, uint32_t len, F f) {
+  const uint32_t packed = C <= MAX_PACKED_CHUNK_LENGTH ? C : 0;
+  uint32_t offset = 0;
+  if (packed > 0) {
+    for (; offset + packed <= s.length(); offset += packed) {
+      f(make_packed_chunk_key<packed>(s.data() + offset));
+    }
+  }
+  for (; offset < s.length(); offset += len) {
+    f(make_chunk_key(s, offset, min(len, static_cast<uint32_t>(s.length()) -
+                                         offset)));
+  }
+}
+
+// Increments the count of each chunk of scratch.shingle. Chunks are located
+// in place and packed into integer keys, so nothing is allocated for chunks
+// already in counts.
+void count_chunks(shingle_scratch& scratch, uint32_t chunk_length,
+                  chunking_mode chunking,
+                  unordered_map<chunk_key,uint32_t>& counts) {
+  const string& shingle = scratch.shingle;
+  if (chunking == CHUNK_FIXED) {
+    DISPATCH_CHUNK_LENGTH(chunk_length, for_each_fixed_chunk, shingle,
+                          chunk_length,
+                          [&](const chunk_key& key) { counts[key]++; });
+    return;
+  }
+
+  uint32_t offset = 0;
+  while (offset < shingle.length()) {
+    uint32_t next = next_chunk_boundary(shingle, offset, chunk_length,
+                                        chunking);
+    counts[make_chunk_key(shingle, offset, next - offset)]++;
+    offset = next;
+  }
+}
+
+// Nodes with a path of at most hops edges to u, including u itself. These
+// are the sources whose (hops + 1)-hop shingles contain u's outgoing edges.
+vector<pair<uint32_t,char>>
+  get_ancestors(const reverse_graph& rg, const pair<uint32_t,char>& u,
+                uint32_t hops) {
+  vector<pair<uint32_t,char>> ancestors(1, u);
+  unordered_set<pair<uint32_t,char>> visited(ancestors.begin(),
+                                             ancestors.end());
+
+  uint32_t level_start = 0;
+  for (uint32_t d = 0; d < hops; d++) {
+    uint32_t level_end = ancestors.size();
+    for (uint32_t i = level_start; i < level_end; i++) {
+      auto it = rg.find(ancestors[i]);
+      if (it == rg.end())
+        continue;
+      for (auto& kv : it->second) {
+        if (visited.insert(kv.first).second) {
+          ancestors.push_back(kv.first);
+        }
+      }
+    }
+    level_start = level_end;
+  }
+
+  return ancestors;
+}
+
+// An edge from u added (inserted = true) or about to be removed changes the
+// k-hop shingle of every source within k-1 hops upstream of u, wherever u
+// appears in it. For each such source, its shingle with and without the
+// edge is chunked, and only chunks that differ are kept.
+void get_changed_k_hop_chunks(const graph& g, const reverse_graph& rg,
+                              const pair<uint32_t,char>& u,
+                              uint32_t edge_index, bool inserted,
+                              uint32_t k, uint32_t chunk_length,
+                              chunking_mode chunking,
+                              vector<chunk_key>& incoming_chunks,
+                              vector<chunk_key>& outgoing_chunks) {
+  bool only_edge = g.at(u).size() == 1;
+
+  for (auto& src : get_ancestors(rg, u, k - 1)) {
+    vector<chunk_key> with_edge =
+      get_chunks(construct_k_hop_shingle(g, src, k), chunk_length, chunking);
+    vector<chunk_key> without_edge;
+    if (!(src == u && only_edge)) { // otherwise u is not a source without it
+      without_edge = get_chunks(construct_k_hop_shingle(g, src, k, &u,
+                                                        edge_index),
+                                chunk_length, chunking);
+    }
+
+    auto& added = inserted ? with_edge : without_edge;
+    auto& removed = inserted ? without_edge : with_edge;
+    incoming_chunks.insert(incoming_chunks.end(), added.begin(), added.end());
+    outgoing_chunks.insert(outgoing_chunks.end(), removed.begin(),
+                           removed.end());
+  }
+
+  cancel_common_chunks(incoming_chunks, outgoing_chunks);
+}
+
+// Per-edge sketch update: the chunks changed by e are found, hashed and
+// applied to the sketch of its graph.
+template<uint32_t k, uint32_t W>
+tuple<vector<int>, chrono::nanoseconds, chrono::nanoseconds>
+update_streamhash_sketches(const edge& e, const vector<graph>& graphs,
+                           const vector<reverse_graph>& reverse_graphs,
+                           vector<sign_sketch<W>>& streamhash_sketches,
+                           vector<vector<double>>& streamhash_projections,
+                           uint32_t chunk_length, chunking_mode chunking,
+                           const hash_family& family) {
+  // for timing
+  chrono::time_point<chrono::steady_clock> start;
+  chrono::time_point<chrono::steady_clock> end;
+  chrono::microseconds shingle_construction_time;
+  chrono::microseconds sketch_update_time;
+
+  auto& gid = get<F_GID>(e);
+
+  start = chrono::steady_clock::now(); // start shingle construction
+
+  vector<chunk_key> incoming_chunks; // to be hashed and added
+  vector<chunk_key> outgoing_chunks; // to be hashed and subtracted
+  get_inserted_chunks<k>(e, graphs, reverse_graphs, chunk_length, chunking,
+                         incoming_chunks, outgoing_chunks);
+
+  end = chrono::steady_clock::now(); // end shingle construction
+  shingle_construction_time =
+    chrono::duration_cast<chrono::microseconds>(end - start);
+
+  start = chrono::steady_clock::now(); // start sketch update
+
+  vector<int> projection_delta =
+    apply_chunk_delta(incoming_chunks, outgoing_chunks,
+                      streamhash_sketches[gid], streamhash_projections[gid],
+                      family);
+
+  end = chrono::steady_clock::now(); // end sketch update
+  sketch_update_time = chrono::duration_cast<chrono::microseconds>(end - start);
+
+  return make_tuple(projection_delta, shingle_construction_time, sketch_update_time);
+}
+
+// Per-edge counterpart of update_streamhash_sketches for edge eviction.
+// Must be called before the edge is removed from the graph.
+template<uint32_t k, uint32_t W>
+tuple<vector<int>, chrono::nanoseconds, chrono::nanoseconds>
+evict_from_streamhash_sketches(const edge& e, const vector<graph>& graphs,
+                               const vector<reverse_graph>& reverse_graphs,
+                               vector<sign_sketch<W>>& streamhash_sketches,
+                               vector<vector<double>>& streamhash_projections,
+                               uint32_t chunk_length, chunking_mode chunking,
+                               const hash_family& family) {
+  // for timing
+  chrono::time_point<chrono::steady_clock> start;
+  chrono::time_point<chrono::steady_clock> end;
+  chrono::microseconds shingle_construction_time;
+  chrono::microseconds sketch_update_time;
+
+  auto& gid = get<F_GID>(e);
+
+  start = chrono::steady_clock::now(); // start shingle construction
+
+  vector<chunk_key> incoming_chunks; // to be hashed and added
+  vector<chunk_key> outgoing_chunks; // to be hashed and subtracted
+  get_evicted_chunks<k>(e, graphs, reverse_graphs, chunk_length, chunking,
+                        incoming_chunks, outgoing_chunks);
+
+  end = chrono::steady_clock::now(); // end shingle construction
+  shingle_construction_time =
+    chrono::duration_cast<chrono::microseconds>(end - start);
+
+  start = chrono::steady_clock::now(); // start sketch update
+
+  vector<int> projection_delta =
+    apply_chunk_delta(incoming_chunks, outgoing_chunks,
+                      streamhash_sketches[gid], streamhash_projections[gid],
+                      family);
+
+  end = chrono::steady_clock::now(); // end sketch update
+  sketch_update_time = chrono::duration_cast<chrono::microseconds>(end - start);
+
+  return make_tuple(projection_delta, shingle_construction_time, sketch_update_time);
+}
+
+// General K: every source whose K-hop shingle passes through the source of
+// e is re-shingled with and without e, and the chunks that differ are kept.
+// Must be called after e is added to the graph.
+template<uint32_t k>
+void get_inserted_chunks(const edge& e, const vector<graph>& graphs,
+                         const vector<reverse_graph>& reverse_graphs,
+                         uint32_t chunk_length, chunking_mode chunking,
+                         vector<chunk_key>& incoming_chunks,
+                         vector<chunk_key>& outgoing_chunks) {
+  auto src = make_pair(get<F_S>(e), get<F_STYPE>(e));
+  auto& gid = get<F_GID>(e);
+  auto& g = graphs[gid];
+
+  // the new edge is the last one from its source
+  get_changed_k_hop_chunks(g, reverse_graphs[gid], src, g.at(src).size() - 1,
+                           true, k, chunk_length, chunking,
+                           incoming_chunks, outgoing_chunks);
+}
+
+// General K counterpart of get_inserted_chunks for edge eviction.
+// Must be called before the edge is removed from the graph.
+template<uint32_t k>
+void get_evicted_chunks(const edge& e, const vector<graph>& graphs,
+                        const vector<reverse_graph>& reverse_graphs,
+                        uint32_t chunk_length, chunking_mode chunking,
+                        vector<chunk_key>& incoming_chunks,
+                        vector<chunk_key>& outgoing_chunks) {
+  auto src = make_pair(get<F_S>(e), get<F_STYPE>(e));
+  auto dest = make_tuple(get<F_D>(e), get<F_DTYPE>(e), get<F_ETYPE>(e));
+  auto& gid = get<F_GID>(e);
+  auto& g = graphs[gid];
+
+  // locate the edge as remove_from_graph will
+  auto& outgoing_edges = g.at(src);
+  uint32_t p = find(outgoing_edges.begin(), outgoing_edges.end(), dest) -
+               outgoing_edges.begin();
+
+  get_changed_k_hop_chunks(g, reverse_graphs[gid], src, p, false, k,
+                           chunk_length, chunking,
+                           incoming_chunks, outgoing_chunks);
+}
+
+// K = 1: only the source node's own shingle changes, and only at its end,
+// so the changed chunks are found without re-shingling.
+template<>
+void get_inserted_chunks<1>(const edge& e, const vector<graph>& graphs,
+                            const vector<reverse_graph>& reverse_graphs,
+                            uint32_t chunk_length, chunking_mode chunking,
+                            vector<chunk_key>& incoming_chunks,
+                            vector<chunk_key>& outgoing_chunks) {
+  // source node = (src_id, src_type)
+  // dst_node = (dst_id, dst_type)
+  // shingle substring = (src_type, e_type, dst_type)
+  //assert(K == 1 && chunk_length >= 4);
+
+  auto& src_id = get<F_S>(e);
+  auto& src_type = get<F_STYPE>(e);
+  auto& gid = get<F_GID>(e);
+  auto& g = graphs[gid];
+
+  auto& outgoing_edges = g.at(make_pair(src_id, src_type));
+
+  if (chunking == CHUNK_CONTENT) {
+    get_appended_content_defined_chunks(src_type, outgoing_edges, chunk_length,
+                                        incoming_chunks, outgoing_chunks);
+  } else {
+    get_appended_fixed_chunks(src_type, outgoing_edges, chunk_length,
+                              incoming_chunks, outgoing_chunks);
+  }
+
+#ifdef DEBUG
+  cout << "Incoming chunks: ";
+  for (auto& c : incoming_chunks) {
+    cout << chunk_string(c) << ",";
+  }
+  cout << endl;
+ 
+  cout << "Outgoing chunks: ";
+  for (auto& c : outgoing_chunks) {
+    cout << chunk_string(c) << ",";
+  }
+  cout << endl;
+#endif
+}
+
+// K = 1 with fixed-size chunks:
 //  Adding a new edge appends 2 characters to the shingle from the source node.
 //  Eg.
 //    abcdabcdababab  K = 3
@@ -259,35 +561,13 @@ void construct_shingle_vectors(vector<shingle_vector>& shingle_vectors,
 //    - Last chunk length > 2
 //      Hash and add last chunk
 //      Hash and remove last chunk - "et"
-tuple<vector<int>, chrono::nanoseconds, chrono::nanoseconds>
-update_streamhash_sketches(const edge& e, const vector<graph>& graphs,
-                           vector<bitset<L>>& streamhash_sketches,
-                           vector<vector<int>>& streamhash_projections,
-                           uint32_t chunk_length,
-                           const vector<vector<uint64_t>>& H) {
-  // source node = (src_id, src_type)
-  // dst_node = (dst_id, dst_type)
-  // shingle substring = (src_type, e_type, dst_type)
-  //assert(K == 1 && chunk_length >= 4);
-
-  // for timing
-  chrono::time_point<chrono::steady_clock> start;
-  chrono::time_point<chrono::steady_clock> end;
-  chrono::microseconds shingle_construction_time;
-  chrono::microseconds sketch_update_time;
-
-  auto& src_id = get<F_S>(e);
-  auto& src_type = get<F_STYPE>(e);
-  auto& gid = get<F_GID>(e);
-
-  auto& sketch = streamhash_sketches[gid];
-  auto& projection = streamhash_projections[gid];
-  auto& g = graphs[gid];
-
-  start = chrono::steady_clock::now(); // start shingle construction
-
+void get_appended_fixed_chunks(char src_type,
+                               const vector<tuple<uint32_t,char,char>>&
+                                 outgoing_edges,
+                               uint32_t chunk_length,
+                               vector<chunk_key>& incoming_chunks,
+                               vector<chunk_key>& outgoing_chunks) {
   // construct the last chunk
-  auto& outgoing_edges = g.at(make_pair(src_id, src_type));
   uint32_t n_outgoing_edges = outgoing_edges.size();
   int shingle_length = 2 * (n_outgoing_edges + 1);
   int last_chunk_length = shingle_length - chunk_length *
@@ -362,71 +642,284 @@ update_streamhash_sketches(const edge& e, const vector<graph>& graphs,
   }
 #endif
 
-  vector<string> incoming_chunks; // to be hashed and added
-  vector<string> outgoing_chunks; // to be hashed and subtracted
-
-  incoming_chunks.push_back(last_chunk);
+  incoming_chunks.push_back(make_chunk_key(last_chunk));
 
   if (n_outgoing_edges > 1) { // this is not the first edge
     if (last_chunk_length == 1) {
-      outgoing_chunks.push_back(sec_last_chunk.substr(0,
-                                                      sec_last_chunk.length() - 1));
+      incoming_chunks.push_back(make_chunk_key(sec_last_chunk));
+      outgoing_chunks.push_back(make_chunk_key(sec_last_chunk, 0,
+                                               sec_last_chunk.length() - 1));
     } else if (last_chunk_length == 2) {
       // do nothing, only incoming chunk is the last chunk
     } else { // 2 < last_chunk_length <= chunk_length, last chunk had 2 chars added
-      outgoing_chunks.push_back(last_chunk.substr(0, last_chunk_length - 2));
+      outgoing_chunks.push_back(make_chunk_key(last_chunk, 0,
+                                               last_chunk_length - 2));
     }
   }
+}
 
-  end = chrono::steady_clock::now(); // end shingle construction
-  shingle_construction_time =
-    chrono::duration_cast<chrono::microseconds>(end - start);
+// With content-defined chunking, boundaries before the last chunk depend
+// only on the characters preceding them, so appending an edge can only
+// replace the last chunk of the shingle with one or two new chunks.
+void get_appended_content_defined_chunks(char src_type,
+                                         const vector<tuple<uint32_t,char,char>>&
+                                           outgoing_edges,
+                                         uint32_t chunk_length,
+                                         vector<chunk_key>& incoming_chunks,
+                                         vector<chunk_key>& outgoing_chunks) {
+  string shingle = construct_node_shingle(src_type, outgoing_edges);
+  uint32_t old_shingle_length = shingle.length() - 2;
+
+  // find the start of the last chunk before the edge was appended
+  uint32_t last_chunk_start = 0;
+  if (outgoing_edges.size() > 1) { // this is not the first edge
+    uint32_t offset = 0;
+    while (offset < old_shingle_length) {
+      last_chunk_start = offset;
+      offset = next_content_defined_boundary(shingle, offset, chunk_length);
+    }
+    outgoing_chunks.push_back(make_chunk_key(shingle, last_chunk_start,
+                                             old_shingle_length -
+                                               last_chunk_start));
+  }
+
+  // re-chunk from there to the end of the new shingle
+  uint32_t offset = last_chunk_start;
+  while (offset < shingle.length()) {
+    uint32_t next = next_content_defined_boundary(shingle, offset,
+                                                  chunk_length);
+    incoming_chunks.push_back(make_chunk_key(shingle, offset, next - offset));
+    offset = next;
+  }
+
+  cancel_common_chunks(incoming_chunks, outgoing_chunks);
+}
+
+// Removing an edge (at position p in the source node's edge list) deletes
+// two characters from the source node's shingle (K = 1).
+//
+//  Chunks before the one containing the removed edge are unchanged. The
+//  rest of the shingle is re-chunked, and chunks that appear in both the
+//  old and the new shingle cancel out, so only chunks that actually changed
+//  are hashed. If this was the last edge from the node, its entire shingle
+//  is removed.
+//
+//  Must be called before the edge is removed from the graph.
+template<>
+void get_evicted_chunks<1>(const edge& e, const vector<graph>& graphs,
+                           const vector<reverse_graph>& reverse_graphs,
+                           uint32_t chunk_length, chunking_mode chunking,
+                           vector<chunk_key>& incoming_chunks,
+                           vector<chunk_key>& outgoing_chunks) {
+  auto& src_id = get<F_S>(e);
+  auto& src_type = get<F_STYPE>(e);
+  auto& dst_id = get<F_D>(e);
+  auto& dst_type = get<F_DTYPE>(e);
+  auto& e_type = get<F_ETYPE>(e);
+  auto& gid = get<F_GID>(e);
+  auto& g = graphs[gid];
+
+  // locate the edge as remove_from_graph will
+  auto& outgoing_edges = g.at(make_pair(src_id, src_type));
+  auto pos = find(outgoing_edges.begin(), outgoing_edges.end(),
+                  make_tuple(dst_id, dst_type, e_type));
+  uint32_t p = pos - outgoing_edges.begin();
+
+  if (outgoing_edges.size() == 1) {
+    // the node is removed from the graph along with its shingle
+    string shingle = construct_node_shingle(src_type, outgoing_edges);
+    outgoing_chunks = get_chunks(shingle, chunk_length, chunking);
+  } else if (chunking == CHUNK_CONTENT) {
+    get_evicted_content_defined_chunks(src_type, outgoing_edges, p,
+                                       chunk_length, incoming_chunks,
+                                       outgoing_chunks);
+  } else {
+    get_evicted_fixed_chunks(src_type, outgoing_edges, p, chunk_length,
+                             incoming_chunks, outgoing_chunks);
+  }
 
 #ifdef DEBUG
-  cout << "Incoming chunks: ";
+  cout << "Evicted incoming chunks: ";
   for (auto& c : incoming_chunks) {
-    cout << c << ",";
+    cout << chunk_string(c) << ",";
   }
   cout << endl;
- 
-  cout << "Outgoing chunks: ";
+
+  cout << "Evicted outgoing chunks: ";
   for (auto& c : outgoing_chunks) {
-    cout << c << ",";
+    cout << chunk_string(c) << ",";
   }
   cout << endl;
 #endif
+}
 
-  // record the change in the projection vector
-  // this is used to update the centroid
-  vector<int> projection_delta(L, 0);
+// With fixed-size chunks, every chunk after the removed edge shifts.
+//  Eg.
+//    " abcdefg"    C = 3
+//    " ab cde fg"
+//
+//    Remove edge "de"
+//    " abcfg"
+//    " ab cfg"
+void get_evicted_fixed_chunks(char src_type,
+                              const vector<tuple<uint32_t,char,char>>&
+                                outgoing_edges,
+                              uint32_t p, uint32_t chunk_length,
+                              vector<chunk_key>& incoming_chunks,
+                              vector<chunk_key>& outgoing_chunks) {
+  // shingle = " " + src_type + (edge_type, dst_type) for each edge
+  auto shingle_char = [&](uint32_t offset) {
+    if (offset == 0)
+      return ' ';
+    if (offset == 1)
+      return src_type;
+    auto& out_edge = outgoing_edges[(offset - 2) / 2];
+    return offset % 2 == 0 ? get<2>(out_edge) : get<1>(out_edge);
+  };
 
-  start = chrono::steady_clock::now(); // start sketch update
+  uint32_t shingle_length = 2 * (outgoing_edges.size() + 1);
+  uint32_t removed_offset = 2 * (p + 1);
+  uint32_t suffix_offset = chunk_length * (removed_offset / chunk_length);
 
-  // update the projection vectors
-  for (auto& chunk : incoming_chunks) {
-    for (uint32_t i = 0; i < L; i++) {
-      int delta = hashmulti(chunk, H[i]);
-      projection[i] += delta;
-      projection_delta[i] += delta;
-    }
+  string old_suffix, new_suffix;
+  old_suffix.reserve(shingle_length - suffix_offset);
+  new_suffix.reserve(shingle_length - suffix_offset);
+  for (uint32_t offset = suffix_offset; offset < shingle_length; offset++) {
+    char c = shingle_char(offset);
+    old_suffix.push_back(c);
+    if (offset != removed_offset && offset != removed_offset + 1)
+      new_suffix.push_back(c);
   }
-  for (auto& chunk : outgoing_chunks) {
-    for (uint32_t i = 0; i < L; i++) {
-      int delta = hashmulti(chunk, H[i]);
-      projection[i] -= delta;
-      projection_delta[i] -= delta;
+
+  outgoing_chunks = get_chunks(old_suffix, chunk_length, CHUNK_FIXED);
+  incoming_chunks = get_chunks(new_suffix, chunk_length, CHUNK_FIXED);
+  cancel_common_chunks(incoming_chunks, outgoing_chunks);
+}
+
+// With content-defined chunks, boundaries re-synchronize shortly after the
+// removed edge: once the old and the new shingle share a boundary whose
+// rolling window lies past the removed edge, all later chunks are
+// identical. Only the chunks in between are returned.
+void get_evicted_content_defined_chunks(char src_type,
+                                        const vector<tuple<uint32_t,char,char>>&
+                                          outgoing_edges,
+                                        uint32_t p, uint32_t chunk_length,
+                                        vector<chunk_key>& incoming_chunks,
+                                        vector<chunk_key>& outgoing_chunks) {
+  string old_shingle = construct_node_shingle(src_type, outgoing_edges);
+  uint32_t removed_offset = 2 * (p + 1);
+  string new_shingle(old_shingle);
+  new_shingle.erase(removed_offset, 2);
+
+  // boundaries up to the removed edge are the same in both shingles
+  uint32_t chunk_start = 0;
+  uint32_t offset = 0;
+  while (offset <= removed_offset) {
+    chunk_start = offset;
+    offset = next_content_defined_boundary(old_shingle, offset, chunk_length);
+  }
+
+  // an old boundary at old_offset corresponds to new_offset = old_offset - 2
+  uint32_t sync_offset = removed_offset + 4;
+  uint32_t old_offset = chunk_start, new_offset = chunk_start;
+  while (old_offset < old_shingle.length() ||
+         new_offset < new_shingle.length()) {
+    if (new_offset >= new_shingle.length() ||
+        (old_offset < old_shingle.length() && old_offset <= new_offset + 2)) {
+      uint32_t next = next_content_defined_boundary(old_shingle, old_offset,
+                                                    chunk_length);
+      outgoing_chunks.push_back(make_chunk_key(old_shingle, old_offset,
+                                               next - old_offset));
+      old_offset = next;
+    } else {
+      uint32_t next = next_content_defined_boundary(new_shingle, new_offset,
+                                                    chunk_length);
+      incoming_chunks.push_back(make_chunk_key(new_shingle, new_offset,
+                                               next - new_offset));
+      new_offset = next;
     }
+
+    if (old_offset >= sync_offset && old_offset == new_offset + 2)
+      break; // the remaining chunks are identical
   }
 
-  // update sketch = sign(projection)
-  for (uint32_t i = 0; i < L; i++) {
-    sketch[i] = projection[i] >= 0 ? 1 : 0;
+  cancel_common_chunks(incoming_chunks, outgoing_chunks);
+}
+
+// Shingle of a source node with K = 1: " " + src_type followed by
+// (edge_type, dst_type) for each outgoing edge.
+string construct_node_shingle(char src_type,
+                              const vector<tuple<uint32_t,char,char>>&
+                                outgoing_edges) {
+  string shingle(" ", 1);
+  shingle.reserve(2 * (outgoing_edges.size() + 1));
+  shingle.push_back(src_type);
+  for (auto& out_edge : outgoing_edges) {
+    shingle.push_back(get<2>(out_edge));
+    shingle.push_back(get<1>(out_edge));
   }
+  return shingle;
+}
 
-  end = chrono::steady_clock::now(); // end sketch update
-  sketch_update_time = chrono::duration_cast<chrono::microseconds>(end - start);
+// Removes chunks present in both lists, leaving the net change.
+void cancel_common_chunks(vector<chunk_key>& incoming_chunks,
+                          vector<chunk_key>& outgoing_chunks) {
+  sort(incoming_chunks.begin(), incoming_chunks.end());
+  sort(outgoing_chunks.begin(), outgoing_chunks.end());
 
-  return make_tuple(projection_delta, shingle_construction_time, sketch_update_time);
+  vector<chunk_key> net_incoming, net_outgoing;
+  set_difference(incoming_chunks.begin(), incoming_chunks.end(),
+                 outgoing_chunks.begin(), outgoing_chunks.end(),
+                 back_inserter(net_incoming));
+  set_difference(outgoing_chunks.begin(), outgoing_chunks.end(),
+                 incoming_chunks.begin(), incoming_chunks.end(),
+                 back_inserter(net_outgoing));
+
+  incoming_chunks.swap(net_incoming);
+  outgoing_chunks.swap(net_outgoing);
+}
+
+// Adds a later change to the same graph to a pending chunk delta. Chunks
+// added by one change and removed by the other cancel out, so they are never
+// hashed. Returns the number of chunks cancelled.
+uint32_t merge_chunk_delta(vector<chunk_key>& incoming_chunks,
+                           vector<chunk_key>& outgoing_chunks,
+                           const vector<chunk_key>& more_incoming_chunks,
+                           const vector<chunk_key>& more_outgoing_chunks) {
+  uint32_t num_chunks = incoming_chunks.size() + outgoing_chunks.size() +
+                        more_incoming_chunks.size() +
+                        more_outgoing_chunks.size();
+  incoming_chunks.insert(incoming_chunks.end(), more_incoming_chunks.begin(),
+                         more_incoming_chunks.end());
+  outgoing_chunks.insert(outgoing_chunks.end(), more_outgoing_chunks.begin(),
+                         more_outgoing_chunks.end());
+  cancel_common_chunks(incoming_chunks, outgoing_chunks);
+  return num_chunks - incoming_chunks.size() - outgoing_chunks.size();
+}
+
+// Hashes incoming chunks into the projection and outgoing chunks out of it,
+// then updates the sketch. Returns the change in the projection vector,
+// which is used to update the centroid.
+template<uint32_t W>
+vector<int> apply_chunk_delta(const vector<chunk_key>& incoming_chunks,
+                              const vector<chunk_key>& outgoing_chunks,
+                              sign_sketch<W>& sketch, vector<double>& projection,
+                              const hash_family& family) {
+  vector<int> projection_delta(W, 0);
+
+  // update the projection vectors
+  for (auto& chunk : incoming_chunks) {
+    add_chunk_bits<W>(hash_chunk<W>(chunk, family), 1, projection,
+                      projection_delta);
+  }
+  for (auto& chunk : outgoing_chunks) {
+    add_chunk_bits<W>(hash_chunk<W>(chunk, family), -1, projection,
+                      projection_delta);
+  }
+
+  sketch.dirty = true; // sketch = sign(projection), when next read
+
+  return projection_delta;
 }
 
 vector<string> get_string_chunks(string s, uint32_t len) {
@@ -437,6 +930,67 @@ vector<string> get_string_chunks(string s, uint32_t len) {
   return chunks;
 }
 
+vector<chunk_key> get_chunks(const string& s, uint32_t len,
+                             chunking_mode chunking) {
+  vector<chunk_key> chunks;
+  if (chunking == CHUNK_FIXED) {
+    DISPATCH_CHUNK_LENGTH(len, for_each_fixed_chunk, s, len,
+                          [&](const chunk_key& key) { chunks.push_back(key); });
+    return chunks;
+  }
+
+  uint32_t offset = 0;
+  while (offset < s.length()) {
+    uint32_t next = next_chunk_boundary(s, offset, len, chunking);
+    chunks.push_back(make_chunk_key(s, offset, next - offset));
+    offset = next;
+  }
+  return chunks;
+}
+
+// End of the chunk of s starting at offset start.
+uint32_t next_chunk_boundary(const string& s, uint32_t start, uint32_t len,
+                             chunking_mode chunking) {
+  if (chunking == CHUNK_CONTENT)
+    return next_content_defined_boundary(s, start, len);
+  return min(start + len, static_cast<uint32_t>(s.length()));
+}
+
+// Content-defined chunking over the (edge type, node type) character pairs
+// of a shingle. A chunk ends after a pair when a rolling hash of the last 4
+// characters hits 1 in len/4 (so chunks average about len/2 characters), or
+// when it reaches len characters. Chunks thus never exceed len, and a
+// boundary depends only on the characters just before it and the distance
+// from the previous boundary.
+uint32_t next_content_defined_boundary(const string& s, uint32_t start,
+                                       uint32_t len) {
+  uint32_t max_length = max(2u, len - len % 2);
+  uint32_t divisor = max(1u, len / 4);
+
+  // window of the last 4 characters, seeded with the 2 before start
+  uint32_t window = 0;
+  if (start >= 2) {
+    window = (static_cast<uint32_t>(static_cast<uint8_t>(s[start - 2])) << 8) |
+             static_cast<uint8_t>(s[start - 1]);
+  }
+
+  uint32_t end = start;
+  while (end < s.length()) {
+    uint32_t pair = static_cast<uint8_t>(s[end]) << 8;
+    if (end + 1 < s.length())
+      pair |= static_cast<uint8_t>(s[end + 1]);
+    window = (window << 16) | pair;
+    end = min(end + 2, static_cast<uint32_t>(s.length()));
+
+    if (end - start >= max_length)
+      break;
+    if (((window * 2654435761u) >> 16) % divisor == 0)
+      break;
+  }
+
+  return end;
+}
+
 double cosine_similarity(const shingle_vector& sv1, const shingle_vector& sv2) {
   double dot_product = 0.0, magnitude1 = 0.0, magnitude2 = 0.0;
 
@@ -460,4 +1014,60 @@ double cosine_similarity(const shingle_vector& sv1, const shingle_vector& sv2) {
   return cosine;
 }
 
+// cosine_similarity of sparse shingle vectors, such as temp shingle vectors
+double cosine_similarity(const unordered_map<chunk_key,uint32_t>& sv1,
+                         const unordered_map<chunk_key,uint32_t>& sv2) {
+  double dot_product = 0.0, magnitude1 = 0.0, magnitude2 = 0.0;
+
+  for (auto& kv : sv1) {
+    magnitude1 += static_cast<double>(kv.second) * kv.second;
+    auto it = sv2.find(kv.first);
+    if (it != sv2.end())
+      dot_product += static_cast<double>(kv.second) * it->second;
+  }
+  for (auto& kv : sv2) {
+    magnitude2 += static_cast<double>(kv.second) * kv.second;
+  }
+
+  return dot_product / (sqrt(magnitude1) * sqrt(magnitude2));
+}
+
+#define INSTANTIATE_SKETCH_UPDATES(W) \
+  template tuple<vector<int>, chrono::nanoseconds, chrono::nanoseconds> \
+    update_streamhash_sketches<K,W>( \
+      const edge& e, const vector<graph>& graphs, \
+      const vector<reverse_graph>& reverse_graphs, \
+      vector<sign_sketch<W>>& streamhash_sketches, \
+      vector<vector<double>>& streamhash_projections, \
+      uint32_t chunk_length, chunking_mode chunking, \
+      const hash_family& family); \
+  template tuple<vector<int>, chrono::nanoseconds, chrono::nanoseconds> \
+    evict_from_streamhash_sketches<K,W>( \
+      const edge& e, const vector<graph>& graphs, \
+      const vector<reverse_graph>& reverse_graphs, \
+      vector<sign_sketch<W>>& streamhash_sketches, \
+      vector<vector<double>>& streamhash_projections, \
+      uint32_t chunk_length, chunking_mode chunking, \
+      const hash_family& family); \
+  template vector<int> \
+    apply_chunk_delta<W>(const vector<chunk_key>& incoming_chunks, \
+                         const vector<chunk_key>& outgoing_chunks, \
+                         sign_sketch<W>& sketch, vector<double>& projection, \
+                         const hash_family& family);
+FOR_EACH_SKETCH_WIDTH(INSTANTIATE_SKETCH_UPDATES)
+#if K > 1
+template void
+get_inserted_chunks<K>(const edge& e, const vector<graph>& graphs,
+                       const vector<reverse_graph>& reverse_graphs,
+                       uint32_t chunk_length, chunking_mode chunking,
+                       vector<chunk_key>& incoming_chunks,
+                       vector<chunk_key>& outgoing_chunks);
+template void
+get_evicted_chunks<K>(const edge& e, const vector<graph>& graphs,
+                      const vector<reverse_graph>& reverse_graphs,
+                      uint32_t chunk_length, chunking_mode chunking,
+                      vector<chunk_key>& incoming_chunks,
+                      vector<chunk_key>& outgoing_chunks);
+#endif
+
 } // namespace
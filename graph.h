@@ -9,8 +9,10 @@
 
 #include <bitset>
 #include <chrono>
+#include "chunk.h"
 #include "param.h"
 #include <string>
+#include "streamhash.h"
 #include <tuple>
 #include <vector>
 #include <unordered_map>
@@ -32,24 +34,148 @@ typedef tuple<uint32_t,char,uint32_t,char,char,uint32_t> edge;
 typedef unordered_map<pair<uint32_t,char>,
                       vector<tuple<uint32_t,char,char>>> graph;
 typedef vector<uint32_t> shingle_vector;
+typedef unordered_map<pair<uint32_t,char>,
+                      unordered_map<pair<uint32_t,char>,uint32_t>> reverse_graph;
+
+// buffers reused across shingle constructions
+struct shingle_scratch {
+  vector<tuple<uint32_t,char,char,uint32_t>> queue; // flat BFS queue
+  string shingle;
+};
+
+// how shingles are split into chunks
+enum chunking_mode {
+  CHUNK_FIXED,      // consecutive chunk_length-character chunks
+  CHUNK_CONTENT     // boundaries chosen by a rolling hash of the content
+};
 
 void update_graphs(edge& e, vector<graph>& graphs);
 void remove_from_graph(edge& e, vector<graph>& graphs);
+void update_reverse_graphs(const edge& e, vector<reverse_graph>& reverse_graphs);
+void remove_from_reverse_graph(const edge& e,
+                               vector<reverse_graph>& reverse_graphs);
 void print_edge(edge& e);
 void print_graph(graph& g);
-unordered_map<string,uint32_t>
-  construct_temp_shingle_vector(const graph& g, uint32_t chunk_length);
+unordered_map<chunk_key,uint32_t>
+  construct_temp_shingle_vector(const graph& g, uint32_t chunk_length,
+                                chunking_mode chunking);
 void construct_shingle_vectors(vector<shingle_vector>& shingle_vectors,
-                               unordered_map<string,uint32_t>& shingle_id,
-                               vector<graph>& graphs, uint32_t chunk_length);
+                               unordered_map<chunk_key,uint32_t>& shingle_id,
+                               vector<graph>& graphs, uint32_t chunk_length,
+                               chunking_mode chunking);
+void construct_k_hop_shingle(const graph& g, const pair<uint32_t,char>& src,
+                             uint32_t hops, shingle_scratch& scratch,
+                             const pair<uint32_t,char>* excluded_node = nullptr,
+                             uint32_t excluded_index = 0);
+string construct_k_hop_shingle(const graph& g, const pair<uint32_t,char>& src,
+                               uint32_t hops,
+                               const pair<uint32_t,char>* excluded_node = nullptr,
+                               uint32_t excluded_index = 0);
+void count_chunks(shingle_scratch& scratch, uint32_t chunk_length,
+                  chunking_mode chunking,
+                  unordered_map<chunk_key,uint32_t>& counts);
+vector<pair<uint32_t,char>>
+  get_ancestors(const reverse_graph& rg, const pair<uint32_t,char>& u,
+                uint32_t hops);
+void get_changed_k_hop_chunks(const graph& g, const reverse_graph& rg,
+                              const pair<uint32_t,char>& u,
+                              uint32_t edge_index, bool inserted,
+                              uint32_t k, uint32_t chunk_length,
+                              chunking_mode chunking,
+                              vector<chunk_key>& incoming_chunks,
+                              vector<chunk_key>& outgoing_chunks);
+
+// k is the shingle hop count K, W the sketch width
+template<uint32_t k, uint32_t W>
 tuple<vector<int>, chrono::nanoseconds, chrono::nanoseconds>
 update_streamhash_sketches(const edge& e, const vector<graph>& graphs,
-                           vector<bitset<L>>& streamhash_sketches,
-                           vector<vector<int>>& streamhash_projections,
-                           uint32_t chunk_length,
-                           const vector<vector<uint64_t>>& H);
+                           const vector<reverse_graph>& reverse_graphs,
+                           vector<sign_sketch<W>>& streamhash_sketches,
+                           vector<vector<double>>& streamhash_projections,
+                           uint32_t chunk_length, chunking_mode chunking,
+                           const hash_family& family);
+template<uint32_t k, uint32_t W>
+tuple<vector<int>, chrono::nanoseconds, chrono::nanoseconds>
+evict_from_streamhash_sketches(const edge& e, const vector<graph>& graphs,
+                               const vector<reverse_graph>& reverse_graphs,
+                               vector<sign_sketch<W>>& streamhash_sketches,
+                               vector<vector<double>>& streamhash_projections,
+                               uint32_t chunk_length, chunking_mode chunking,
+                               const hash_family& family);
+
+// chunks changed by an edge, k = 1 is specialized
+template<uint32_t k>
+void get_inserted_chunks(const edge& e, const vector<graph>& graphs,
+                         const vector<reverse_graph>& reverse_graphs,
+                         uint32_t chunk_length, chunking_mode chunking,
+                         vector<chunk_key>& incoming_chunks,
+                         vector<chunk_key>& outgoing_chunks);
+template<>
+void get_inserted_chunks<1>(const edge& e, const vector<graph>& graphs,
+                            const vector<reverse_graph>& reverse_graphs,
+                            uint32_t chunk_length, chunking_mode chunking,
+                            vector<chunk_key>& incoming_chunks,
+                            vector<chunk_key>& outgoing_chunks);
+template<uint32_t k>
+void get_evicted_chunks(const edge& e, const vector<graph>& graphs,
+                        const vector<reverse_graph>& reverse_graphs,
+                        uint32_t chunk_length, chunking_mode chunking,
+                        vector<chunk_key>& incoming_chunks,
+                        vector<chunk_key>& outgoing_chunks);
+template<>
+void get_evicted_chunks<1>(const edge& e, const vector<graph>& graphs,
+                           const vector<reverse_graph>& reverse_graphs,
+                           uint32_t chunk_length, chunking_mode chunking,
+                           vector<chunk_key>& incoming_chunks,
+                           vector<chunk_key>& outgoing_chunks);
+void get_appended_fixed_chunks(char src_type,
+                               const vector<tuple<uint32_t,char,char>>&
+                                 outgoing_edges,
+                               uint32_t chunk_length,
+                               vector<chunk_key>& incoming_chunks,
+                               vector<chunk_key>& outgoing_chunks);
+void get_appended_content_defined_chunks(char src_type,
+                                         const vector<tuple<uint32_t,char,char>>&
+                                           outgoing_edges,
+                                         uint32_t chunk_length,
+                                         vector<chunk_key>& incoming_chunks,
+                                         vector<chunk_key>& outgoing_chunks);
+void get_evicted_fixed_chunks(char src_type,
+                              const vector<tuple<uint32_t,char,char>>&
+                                outgoing_edges,
+                              uint32_t p, uint32_t chunk_length,
+                              vector<chunk_key>& incoming_chunks,
+                              vector<chunk_key>& outgoing_chunks);
+void get_evicted_content_defined_chunks(char src_type,
+                                        const vector<tuple<uint32_t,char,char>>&
+                                          outgoing_edges,
+                                        uint32_t p, uint32_t chunk_length,
+                                        vector<chunk_key>& incoming_chunks,
+                                        vector<chunk_key>& outgoing_chunks);
+string construct_node_shingle(char src_type,
+                              const vector<tuple<uint32_t,char,char>>&
+                                outgoing_edges);
+void cancel_common_chunks(vector<chunk_key>& incoming_chunks,
+                          vector<chunk_key>& outgoing_chunks);
+uint32_t merge_chunk_delta(vector<chunk_key>& incoming_chunks,
+                           vector<chunk_key>& outgoing_chunks,
+                           const vector<chunk_key>& more_incoming_chunks,
+                           const vector<chunk_key>& more_outgoing_chunks);
+template<uint32_t W>
+vector<int> apply_chunk_delta(const vector<chunk_key>& incoming_chunks,
+                              const vector<chunk_key>& outgoing_chunks,
+                              sign_sketch<W>& sketch, vector<double>& projection,
+                              const hash_family& family);
 double cosine_similarity(const shingle_vector& sv1, const shingle_vector& sv2);
+double cosine_similarity(const unordered_map<chunk_key,uint32_t>& sv1,
+                         const unordered_map<chunk_key,uint32_t>& sv2);
 vector<string> get_string_chunks(string s, uint32_t len);
+vector<chunk_key> get_chunks(const string& s, uint32_t len,
+                             chunking_mode chunking);
+uint32_t next_chunk_boundary(const string& s, uint32_t start, uint32_t len,
+                             chunking_mode chunking);
+uint32_t next_content_defined_boundary(const string& s, uint32_t start,
+                                       uint32_t len);
 
 }
 
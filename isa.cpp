@@ -0,0 +1,62 @@
+/*
+ * Copyright 2016 Emaad Ahmed Manzoor
+ * License: Apache License, Version 2.0
+ * http://www3.cs.stonybrook.edu/~emanzoor/streamspot/
+ */
+
+#include "isa.h"
+#include <string>
+
+namespace std {
+
+// Best instruction set supported by the CPU and enabled by the OS.
+isa_level detect_isa() {
+#ifdef ISA_DISPATCH
+  __builtin_cpu_init();
+  bool avx2 = __builtin_cpu_supports("avx2") &&
+              __builtin_cpu_supports("fma") &&
+              __builtin_cpu_supports("bmi2") &&
+              __builtin_cpu_supports("popcnt");
+  bool avx512 = avx2 &&
+                __builtin_cpu_supports("avx512f") &&
+                __builtin_cpu_supports("avx512bw") &&
+                __builtin_cpu_supports("avx512dq") &&
+                __builtin_cpu_supports("avx512vl");
+  if (avx512)
+    return ISA_AVX512;
+  if (avx2)
+    return ISA_AVX2;
+#endif
+  return ISA_SCALAR;
+}
+
+static isa_level selected_isa = detect_isa(); // chosen at startup
+
+isa_level kernel_isa() {
+  return selected_isa;
+}
+
+// Forces the kernels for a level, which must not exceed detect_isa().
+void set_kernel_isa(isa_level level) {
+  selected_isa = level;
+}
+
+const char* isa_name(isa_level level) {
+  switch (level) {
+    case ISA_AVX512: return "avx512";
+    case ISA_AVX2:   return "avx2";
+    default:         return "scalar";
+  }
+}
+
+bool parse_isa(const string& name, isa_level& level) {
+  for (isa_level l : { ISA_SCALAR, ISA_AVX2, ISA_AVX512 }) {
+    if (name.compare(isa_name(l)) == 0) {
+      level = l;
+      return true;
+    }
+  }
+  return false;
+}
+
+}
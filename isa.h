@@ -0,0 +1,49 @@
+/*
+ * Copyright 2016 Emaad Ahmed Manzoor
+ * License: Apache License, Version 2.0
+ * http://www3.cs.stonybrook.edu/~emanzoor/streamspot/
+ */
+
+#ifndef STREAMSPOT_ISA_H_
+#define STREAMSPOT_ISA_H_
+
+#include <string>
+
+namespace std {
+
+/* Instruction sets the hot kernels are compiled for.
+ *
+ * Each kernel has a body that is always inlined into one function per
+ * instruction set, and the function for the selected set is called. The
+ * binary is built for the baseline of the target, so it runs anywhere, and
+ * the best set supported by the CPU is selected at startup.
+ */
+enum isa_level {
+  ISA_SCALAR,       // baseline of the target, SSE2 on x86-64
+  ISA_AVX2,         // AVX2, FMA, BMI2 and POPCNT
+  ISA_AVX512        // AVX2 level plus AVX-512 F, BW, DQ and VL
+};
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ISA_DISPATCH
+#define TARGET_AVX2   __attribute__((target("avx2,fma,bmi,bmi2,popcnt")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx512bw,avx512dq," \
+                                            "avx512vl,avx2,fma,bmi,bmi2," \
+                                            "popcnt")))
+#else
+#define TARGET_AVX2   // only the scalar kernels are selected
+#define TARGET_AVX512
+#endif
+
+// kernel bodies, so that they are compiled for each caller's target
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+isa_level detect_isa();
+isa_level kernel_isa();
+void set_kernel_isa(isa_level level);
+const char* isa_name(isa_level level);
+bool parse_isa(const string& name, isa_level& level);
+
+}
+
+#endif
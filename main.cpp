@@ -9,7 +9,10 @@
 #include <cassert>
 #include <chrono>
 #include <deque>
+#include <fstream>
 #include <iostream>
+#include <limits>
+#include <memory>
 #include <queue>
 #include <random>
 #include <string>
@@ -17,14 +20,21 @@
 #include <unordered_set>
 #include <vector>
 
+#include "anomaly_index.h"
+#include "chunk.h"
 #include "cluster.h"
 #include "docopt.h"
+#include "events.h"
 #include "graph.h"
 #include "hash.h"
 #include "io.h"
+#include "isa.h"
 #include "param.h"
+#include "quantile.h"
+#include "rescore.h"
 #include "simhash.h"
 #include "streamhash.h"
+#include "thread_pool.h"
 
 using namespace std;
 
@@ -36,7 +46,28 @@ R"(StreamSpot.
                  --bootstrap=<bootstrap clusters file>
                  --chunk-length=<chunk length>
                  --num-parallel-graphs=<num parallel graphs>
+                 [--chunking=<chunking>]
                  [--max-num-edges=<max num edges>]
+                 [--decay=<decay factor>]
+                 [--chunk-dictionary]
+                 [--num-threads=<num threads>]
+                 [--batch-size=<batch size>]
+                 [--coalesce=<max burst>]
+                 [--max-check-interval=<max interval>]
+                 [--max-check-drift=<max drift>]
+                 [--centroid-index]
+                 [--search-cascade]
+                 [--rescore-interval=<edges>]
+                 [--top-anomalies=<k>]
+                 [--events=<events file>]
+                 [--alert-threshold=<score>]
+                 [--threshold-quantile=<q>]
+                 [--spawn-clusters=<min graphs>]
+                 [--sketch-width=<sketch width>]
+                 [--isa=<isa>]
+                 [--hash-family=<family>]
+                 [--benchmark-hash]
+                 [--stats]
                  [--dataset=<dataset>]
 
       streamspot (-h | --help)
@@ -46,14 +77,77 @@ R"(StreamSpot.
       --edges=<edge file>                     Incoming stream of edges.
       --bootstrap=<bootstrap clusters file>   Bootstrap clusters.
       --chunk-length=<chunk length>           Parameter C.
+      --chunking=<chunking>                   'fixed', 'content' [default: fixed].
       --max-num-edges=<max num edges>         Parameter N [default: inf].
+      --decay=<decay factor>                  Per-edge projection decay in (0,1],
+                                              replaces edge eviction.
+      --chunk-dictionary                      Intern chunks and memoize their
+                                              hashes, uses more memory.
+      --num-threads=<num threads>             Bootstrap threads, defaults to
+                                              the number of cores.
+      --batch-size=<batch size>               Edges per sketch update batch
+                                              [default: 1].
+      --coalesce=<max burst>                  Merge up to this many consecutive
+                                              edges of a graph into one sketch
+                                              and cluster update [default: 1].
+      --max-check-interval=<max interval>     Search for the nearest centroid of
+                                              a stable graph at most once every
+                                              this many updates [default: 1].
+      --max-check-drift=<max drift>           Sketch bits a graph may change by
+                                              between searches to be considered
+                                              stable [default: 10].
+      --centroid-index                        Search only the clusters sharing
+                                              an LSH band with a graph, or all
+                                              if none is within its threshold.
+      --search-cascade                        Compare sketches with centroids
+                                              a block of bits at a time, and
+                                              stop once a centroid cannot be
+                                              the nearest.
+      --rescore-interval=<edges>              Rescore all graphs against the
+                                              centroids in the background,
+                                              at most once every this many
+                                              edges; scores then depend on
+                                              timing. 0 disables [default: 0].
+      --top-anomalies=<k>                     Also print the k most anomalous
+                                              graphs at every iteration
+                                              [default: 0].
+      --events=<events file>                  Write anomaly events to this
+                                              file as they happen.
+      --alert-threshold=<score>               Also fire events when a score
+                                              crosses this, defaults to none.
+      --threshold-quantile=<q>                Reset the thresholds regularly
+                                              to this quantile of the recent
+                                              distances of graphs to their
+                                              nearest centroid, defaults to
+                                              the bootstrap thresholds.
+      --spawn-clusters=<min graphs>           Regularly make a cluster of at
+                                              least this many anomalies near
+                                              one another, and merge clusters
+                                              whose centroids meet. 0
+                                              disables [default: 0].
+      --sketch-width=<sketch width>           Parameter L, one of 256, 512,
+                                              1000, 2048, defaults to 1000.
+      --isa=<isa>                             Kernels: 'scalar', 'avx2',
+                                              'avx512', defaults to the best
+                                              supported by the CPU.
+      --hash-family=<family>                  StreamHash hash functions:
+                                              'multilinear', 'tabulation'
+                                              [default: multilinear].
+      --benchmark-hash                        Compare the speed and accuracy
+                                              of the hash families on the
+                                              training graphs, then exit.
+      --stats                                 Also print timing and search
+                                              statistics of the run.
       --dataset=<dataset>                     'all', 'ydc', 'gfc' [default: all].
 )";
 
-void allocate_random_bits(vector<vector<uint64_t>>&, mt19937_64&, uint32_t);
+template<uint32_t W>
+void benchmark_hash_families(const vector<graph>& graphs,
+                             const vector<uint32_t>& train_gid_list,
+                             uint32_t chunk_length, chunking_mode chunking);
 void compute_similarities(const vector<shingle_vector>& shingle_vectors,
                           const vector<bitset<L>>& simhash_sketches,
-                          const vector<bitset<L>>& streamhash_sketches);
+                          const vector<sign_sketch<L>>& streamhash_sketches);
 void construct_random_vectors(vector<vector<int>>& random_vectors,
                               uint32_t rvsize,
                               bernoulli_distribution& bernoulli,
@@ -63,29 +157,23 @@ void construct_simhash_sketches(const vector<shingle_vector>& shingle_vectors,
                                 vector<bitset<L>>& simhash_sketches);
 void perform_lsh_banding(const vector<uint32_t>& normal_gids,
                          const vector<bitset<L>>& simhash_sketches,
-                         vector<unordered_map<bitset<R>,vector<uint32_t>>>&
-                            hash_tables);
+                         vector<band_table>& hash_tables);
 void print_lsh_clusters(const vector<uint32_t>& normal_gids,
                         const vector<bitset<L>>& simhash_sketches,
-                        const vector<unordered_map<bitset<R>,vector<uint32_t>>>&
-                            hash_tables);
+                        const vector<band_table>& hash_tables);
 void test_anomalies(uint32_t num_graphs,
                     const vector<bitset<L>>& simhash_sketches,
-                    const vector<unordered_map<bitset<R>,vector<uint32_t>>>&
-                      hash_tables);
-
-int main(int argc, char *argv[]) {
-  vector<vector<uint64_t>> H(L);                 // Universal family H, contains
-                                                 // L hash functions, each
-                                                 // represented by chunk_length+2
-                                                 // 64-bit random integers
+                    const vector<band_table>& hash_tables);
 
+// StreamSpot with sketches of width W, see FOR_EACH_SKETCH_WIDTH
+template<uint32_t W>
+int run_streamspot(map<string, docopt::value>& args) {
   mt19937_64 prng(SEED);                         // Mersenne Twister 64-bit PRNG
   bernoulli_distribution bernoulli(0.5);         // to generate random vectors
   vector<vector<int>> random_vectors(L);         // |S|-element random vectors
-  unordered_map<string,uint32_t> shingle_id;
-  unordered_set<string> unique_shingles;
-  //vector<unordered_map<bitset<R>,vector<uint32_t>>> hash_tables(B);
+  unordered_map<chunk_key,uint32_t> shingle_id;
+  unordered_set<chunk_key> unique_shingles;
+  //vector<band_table> hash_tables(B);
 
   // for timing
   chrono::time_point<chrono::steady_clock> start;
@@ -93,18 +181,132 @@ int main(int argc, char *argv[]) {
   chrono::nanoseconds diff;
 
   // arguments
-  map<string, docopt::value> args = docopt::docopt(USAGE, { argv + 1, argv + argc });
-
   string edge_file(args["--edges"].asString());
   string bootstrap_file(args["--bootstrap"].asString());
   uint32_t chunk_length = args["--chunk-length"].asLong();
   uint32_t par = args["--num-parallel-graphs"].asLong();
+  bool print_stats = args["--stats"].asBool();
+
+  chunking_mode chunking = CHUNK_FIXED;
+  string chunking_name("fixed");
+  if (args["--chunking"]) {
+    chunking_name = args["--chunking"].asString();
+  }
+  if (chunking_name.compare("content") == 0) {
+    chunking = CHUNK_CONTENT;
+  } else if (chunking_name.compare("fixed") != 0) {
+    cout << "Invalid chunking: " << chunking_name << ". ";
+    cout << "Should be 'fixed' | 'content'." << endl;
+    exit(-1);
+  }
 
   int max_num_edges = -1;
-  if (args.find("--max-num-edges") != args.end()) {
+  if (args["--max-num-edges"].asString().compare("inf") != 0) {
     max_num_edges = args["--max-num-edges"].asLong();
   }
 
+  double decay = 1.0;
+  if (args["--decay"]) {
+    decay = stod(args["--decay"].asString());
+  }
+
+  if (decay <= 0.0 || decay > 1.0) {
+    cout << "Invalid decay factor: " << decay << ". ";
+    cout << "Should be in (0,1]." << endl;
+    exit(-1);
+  } else if (decay < 1.0 && max_num_edges > 0) {
+    cout << "--decay and --max-num-edges are mutually exclusive." << endl;
+    exit(-1);
+  }
+
+  if (args["--chunk-dictionary"].asBool()) {
+    enable_chunk_dictionary();
+  }
+
+  uint32_t num_threads = default_num_threads();
+  if (args["--num-threads"]) {
+    long n = args["--num-threads"].asLong();
+    if (n < 1) {
+      cout << "Invalid number of threads: " << n << ". ";
+      cout << "Should be at least 1." << endl;
+      exit(-1);
+    }
+    num_threads = n;
+  }
+
+  long batch_size = args["--batch-size"].asLong();
+  if (batch_size < 1) {
+    cout << "Invalid batch size: " << batch_size << ". ";
+    cout << "Should be at least 1." << endl;
+    exit(-1);
+  }
+
+  long coalesce = args["--coalesce"].asLong();
+  if (coalesce < 1) {
+    cout << "Invalid burst length: " << coalesce << ". ";
+    cout << "Should be at least 1." << endl;
+    exit(-1);
+  }
+
+  long max_check_interval = args["--max-check-interval"].asLong();
+  if (max_check_interval < 1) {
+    cout << "Invalid check interval: " << max_check_interval << ". ";
+    cout << "Should be at least 1." << endl;
+    exit(-1);
+  }
+
+  long max_check_drift = args["--max-check-drift"].asLong();
+  if (max_check_drift < 0 || max_check_drift > W) {
+    cout << "Invalid check drift: " << max_check_drift << ". ";
+    cout << "Should be in [0," << W << "]." << endl;
+    exit(-1);
+  }
+
+  long rescore_interval = args["--rescore-interval"].asLong();
+  if (rescore_interval < 0) {
+    cout << "Invalid rescore interval: " << rescore_interval << ". ";
+    cout << "Should be at least 0." << endl;
+    exit(-1);
+  }
+
+  long num_top_anomalies = args["--top-anomalies"].asLong();
+  if (num_top_anomalies < 0) {
+    cout << "Invalid number of top anomalies: " << num_top_anomalies << ". ";
+    cout << "Should be at least 0." << endl;
+    exit(-1);
+  }
+
+  double alert_threshold = numeric_limits<double>::infinity();
+  if (args["--alert-threshold"]) {
+    alert_threshold = stod(args["--alert-threshold"].asString());
+  }
+
+  double threshold_quantile = 0.0;
+  bool calibrating = static_cast<bool>(args["--threshold-quantile"]);
+  if (calibrating) {
+    threshold_quantile = stod(args["--threshold-quantile"].asString());
+    if (threshold_quantile <= 0.0 || threshold_quantile > 1.0) {
+      cout << "Invalid threshold quantile: " << threshold_quantile << ". ";
+      cout << "Should be in (0,1]." << endl;
+      exit(-1);
+    }
+  }
+
+  long spawn_min_graphs = args["--spawn-clusters"].asLong();
+  if (spawn_min_graphs < 0 || spawn_min_graphs == 1) {
+    cout << "Invalid minimum graphs to spawn a cluster: " << spawn_min_graphs;
+    cout << ". Should be 0 or at least 2." << endl;
+    exit(-1);
+  }
+
+  hash_family_kind hash_kind;
+  string hash_name = args["--hash-family"].asString();
+  if (!parse_hash_family(hash_name, hash_kind)) {
+    cout << "Invalid hash family: " << hash_name << ". ";
+    cout << "Should be 'multilinear' | 'tabulation'." << endl;
+    exit(-1);
+  }
+
   string dataset("all");
   if (args.find("--dataset") != args.end()) {
     dataset = args["--dataset"].asString();
@@ -120,10 +322,22 @@ int main(int argc, char *argv[]) {
 
   cout << "StreamSpot (";
   cout << "C=" << chunk_length << ", ";
-  cout << "L=" << L << ", ";
+  if (chunking == CHUNK_CONTENT) {
+    cout << "CHUNKING=" << chunking_name << ", ";
+  }
+  cout << "L=" << W << ", ";
+  if (hash_kind != HASH_MULTILINEAR) {
+    cout << "HASH=" << hash_family_name(hash_kind) << ", ";
+  }
   cout << "N=" << max_num_edges << ", ";
   cout << "P=" << par << ", ";
+  if (decay < 1.0) {
+    cout << "D=" << decay << ", ";
+  }
   cout << "DATA=" << dataset << ")" << endl;
+  if (print_stats) {
+    cout << "Kernels: " << isa_name(kernel_isa()) << endl;
+  }
 
   unordered_set<uint32_t> scenarios;
   if (dataset.compare("gfc") == 0) {
@@ -145,8 +359,7 @@ int main(int argc, char *argv[]) {
     scenarios.insert(5);
   }
 
-  // FIXME: Tailored for this configuration now
-  assert(K == 1 && chunk_length >= 4);
+  assert(chunk_length >= 4);
 
   // read bootstrap clusters and thresholds
   vector<vector<uint32_t>> clusters;
@@ -229,27 +442,70 @@ int main(int argc, char *argv[]) {
 
   // per-graph data structures
   vector<graph> graphs(num_graphs);
-  vector<bitset<L>> streamhash_sketches(num_graphs);
-  vector<vector<int>> streamhash_projections(num_graphs, vector<int>(L, 0));
+  vector<reverse_graph> reverse_graphs(num_graphs); // only used if K > 1
+  vector<sign_sketch<W>> streamhash_sketches(num_graphs);
+  vector<vector<double>> streamhash_projections(num_graphs,
+                                                vector<double>(W, 0.0));
+  vector<uint32_t> graph_epochs(num_graphs, 0);  // last decay of projection
   vector<bitset<L>> simhash_sketches(num_graphs);
   vector<shingle_vector> shingle_vectors(num_graphs);
 
+  // bootstrap work is split across threads by graph, each graph is only
+  // touched by one thread so the results do not depend on scheduling
+  thread_pool pool(num_threads);
+  vector<uint32_t> train_gid_list(train_gids.begin(), train_gids.end());
+  auto bootstrap_start = chrono::steady_clock::now();
+
   // construct bootstrap graphs offline
   cout << "Constructing " << train_gids.size() << " training graphs:" << endl;
-  for (auto& e : train_edges) {
-    update_graphs(e, graphs);
+  vector<vector<uint32_t>> train_edges_by_graph(num_graphs);
+  for (uint32_t i = 0; i < train_edges.size(); i++) {
+    train_edges_by_graph[get<F_GID>(train_edges[i])].push_back(i);
+  }
+  pool.parallel_for(train_gid_list.size(), [&](uint32_t i) {
+    for (auto& edge_index : train_edges_by_graph[train_gid_list[i]]) {
+      auto& e = train_edges[edge_index];
+      update_graphs(e, graphs);
+      if (K > 1) {
+        update_reverse_graphs(e, reverse_graphs);
+      }
+    }
+  });
+
+  if (args["--benchmark-hash"].asBool()) {
+    benchmark_hash_families<W>(graphs, train_gid_list, chunk_length, chunking);
+    return 0;
   }
 
   // set up universal hash family for StreamHash
-  allocate_random_bits(H, prng, chunk_length);
+  hash_family family = make_hash_family(hash_kind, W, chunk_length, prng);
 
   // construct StreamHash sketches for bootstrap graphs offline
   cout << "Constructing StreamHash sketches for training graphs:" << endl;
-  for (auto& gid : train_gids) {
-    unordered_map<string,uint32_t> temp_shingle_vector =
-      construct_temp_shingle_vector(graphs[gid], chunk_length);
+  vector<uint32_t> num_shingles(train_gid_list.size());
+  vector<chrono::nanoseconds> sketch_times(train_gid_list.size());
+  pool.parallel_for(train_gid_list.size(), [&](uint32_t i) {
+    auto gid = train_gid_list[i];
+    unordered_map<chunk_key,uint32_t> temp_shingle_vector =
+      construct_temp_shingle_vector(graphs[gid], chunk_length, chunking);
+    auto sketch_start = chrono::steady_clock::now();
     tie(streamhash_sketches[gid], streamhash_projections[gid]) =
-      construct_streamhash_sketch(temp_shingle_vector, H);
+      construct_streamhash_sketch<W>(temp_shingle_vector, family);
+    sketch_times[i] = chrono::steady_clock::now() - sketch_start;
+    num_shingles[i] = temp_shingle_vector.size();
+  });
+
+  // sketch throughput per thread, shingle construction excluded
+  uint64_t total_shingles = 0;
+  chrono::nanoseconds total_sketch_time(0);
+  for (uint32_t i = 0; i < train_gid_list.size(); i++) {
+    total_shingles += num_shingles[i];
+    total_sketch_time += sketch_times[i];
+  }
+  if (print_stats) {
+    cout << "\tSketched " << total_shingles << " shingles at ";
+    cout << total_shingles / max(1e-9, total_sketch_time.count() / 1e9);
+    cout << " shingles/s" << endl;
   }
 
 #ifdef DEBUG
@@ -264,22 +520,81 @@ int main(int argc, char *argv[]) {
   }
 #endif
 
-  // per-cluster data structures
+  // per-cluster data structures, with room for the clusters spawned online
+  // so that adding one does not reallocate them
+  uint32_t cluster_capacity = nclusters;
+  if (spawn_min_graphs > 0) {
+    cluster_capacity += MAX_SPAWNED_CLUSTERS;
+  }
   vector<vector<double>> centroid_projections;
-  vector<bitset<L>> centroid_sketches;
+  vector<sign_sketch<W>> centroid_sketches;
+  vector<uint32_t> centroid_epochs(nclusters, 0);
+  vector<cluster_schedule<W>> cluster_schedules(num_graphs);
+  uint64_t num_cluster_updates = 0;
+  uint64_t num_skipped_searches = 0;
 
   // construct cluster centroid sketches/projections
   cout << "Constructing bootstrap cluster centroids:" << endl;
   tie(centroid_sketches, centroid_projections) =
-    construct_centroid_sketches(streamhash_projections, clusters, nclusters);
+    construct_centroid_sketches<W>(streamhash_projections, clusters,
+                                   nclusters, pool);
+  centroid_projections.reserve(cluster_capacity);
+  centroid_sketches.reserve(cluster_capacity);
+  centroid_epochs.reserve(cluster_capacity);
+  cluster_sizes.reserve(cluster_capacity);
+  cluster_thresholds.reserve(cluster_capacity);
+
+  // index the centroids by their bands
+  centroid_index<W> index;
+  bool use_centroid_index = args["--centroid-index"].asBool();
+  if (use_centroid_index) {
+    build_centroid_index<W>(index, centroid_sketches, centroid_projections,
+                            cluster_capacity);
+  }
+
+  // distances between centroids, to prune nearest centroid searches
+  centroid_bounds<W> bounds;
+  build_centroid_bounds<W>(bounds, centroid_sketches, centroid_projections,
+                           cluster_capacity);
+  bool use_search_cascade = args["--search-cascade"].asBool();
 
   // compute distances of training graphs to their cluster centroids
   vector<double> anomaly_scores(num_graphs, UNSEEN);
-  for (auto& gid : train_gids) {
+  pool.parallel_for(train_gid_list.size(), [&](uint32_t i) {
+    auto gid = train_gid_list[i];
     // anomaly score is a "distance", hence the 1.0 - x
     anomaly_scores[gid] = 1.0 -
       cos(PI*(1.0 - streamhash_similarity(streamhash_sketches[gid],
                                           centroid_sketches[cluster_map[gid]])));
+  });
+
+  // the most anomalous graphs, kept up to date with anomaly_scores
+  anomaly_index top_index;
+  init_anomaly_index(top_index, num_graphs);
+  for (auto& gid : train_gid_list) {
+    update_anomaly_index(top_index, gid, anomaly_scores[gid]);
+  }
+
+  // recent distances to the centroids, seeded with the training graphs'
+  threshold_calibration calibration;
+  double bootstrap_global_threshold = global_threshold;
+  uint32_t last_calibration_edge = 0;
+  uint32_t num_recalibrations = 0;
+  if (calibrating) {
+    init_threshold_calibration(calibration, nclusters);
+    calibration.current.reserve(cluster_capacity);
+    calibration.previous.reserve(cluster_capacity);
+    for (auto& gid : train_gid_list) {
+      record_cluster_distance(calibration, cluster_map[gid],
+                              anomaly_scores[gid]);
+    }
+  }
+
+  auto bootstrap_time = chrono::duration_cast<chrono::milliseconds>(
+    chrono::steady_clock::now() - bootstrap_start);
+  if (print_stats) {
+    cout << "Bootstrap took " << bootstrap_time.count() << "ms";
+    cout << " (" << pool.size() << " threads)" << endl;
   }
 
 #ifdef DEBUG
@@ -311,6 +626,7 @@ int main(int argc, char *argv[]) {
                                                   vector<double>(num_graphs));
   vector<vector<int>> cluster_map_iterations(num_intervals,
                                              vector<int>(num_graphs));
+  vector<vector<pair<uint32_t,double>>> top_anomaly_iterations(num_intervals);
 
   uint32_t cache_size = num_test_edges;
   if (max_num_edges > 0) {
@@ -318,7 +634,293 @@ int main(int argc, char *argv[]) {
   }
   deque<edge> cache;
 
+  // Sketch updates are batched: chunks changed by batch_size edges are
+  // collected while the graphs are updated, hashed together in one sweep
+  // of H, and then applied to the sketches and clusters in arrival order.
   uint32_t edge_num = 0;
+  uint32_t batch_start = 0;       // first edge of the current batch
+  chunk_batch batch;
+  vector<sketch_delta> pending_deltas;
+  auto push_delta = [&](uint32_t gid, uint32_t n, bool inserted,
+                        const vector<chunk_key>& incoming_chunks,
+                        const vector<chunk_key>& outgoing_chunks) {
+    pending_deltas.push_back(sketch_delta());
+    auto& delta = pending_deltas.back();
+    delta.gid = gid;
+    delta.edge_num = n;
+    delta.inserted = inserted;
+    delta.incoming_chunks = add_to_chunk_batch(batch, incoming_chunks);
+    delta.outgoing_chunks = add_to_chunk_batch(batch, outgoing_chunks);
+  };
+
+  // Consecutive edges of the same graph are coalesced into a burst, whose
+  // net chunk delta gets one sketch and cluster update at its last edge.
+  // A burst ends at an edge of another graph, after coalesce edges, and
+  // at the edges where anomaly scores are stored.
+  uint32_t burst_gid = 0;
+  uint32_t burst_edge_num = 0;    // last edge of the burst
+  uint32_t burst_edges = 0;       // 0 if no burst is open
+  vector<chunk_key> burst_incoming_chunks, burst_outgoing_chunks;
+  uint32_t num_bursts = 0;
+  uint64_t num_cancelled_chunks = 0;
+  auto flush_burst = [&]() {
+    if (burst_edges == 0)
+      return;
+    push_delta(burst_gid, burst_edge_num, true, burst_incoming_chunks,
+               burst_outgoing_chunks);
+    burst_incoming_chunks.clear();
+    burst_outgoing_chunks.clear();
+    burst_edges = 0;
+    num_bursts++;
+  };
+  // Anomaly events are queued as graphs are updated, and written to the
+  // events file by a background thread. A callback counts them by kind.
+  anomaly_monitor monitor;
+  monitor.threshold = alert_threshold;
+  monitor.queue = nullptr;
+  monitor.num_events = 0;
+  monitor.num_dropped = 0;
+  unique_ptr<event_queue> events;
+  ofstream events_out;
+  unique_ptr<event_writer> writer;
+  vector<chrono::steady_clock::time_point> edge_arrivals;
+  uint64_t num_events_by_kind[EVENT_BELOW + 1] = { 0, 0, 0 };
+  if (args["--events"]) {
+    string events_file = args["--events"].asString();
+    events_out.open(events_file);
+    if (!events_out) {
+      cout << "Could not open events file: " << events_file << endl;
+      exit(-1);
+    }
+    events.reset(new event_queue(EVENT_QUEUE_CAPACITY));
+    monitor.queue = events.get();
+    monitor.callbacks.push_back([&](const anomaly_event& event) {
+      num_events_by_kind[event.kind]++;
+    });
+    writer.reset(new event_writer(*events, events_out));
+    edge_arrivals.resize(num_test_edges);
+  }
+
+  // All live graphs are rescored against the centroids in the background,
+  // every rescore_interval edges at most. A result only replaces the scores
+  // of the graphs that have not been updated since its snapshot was taken.
+  unique_ptr<rescorer<W>> background;
+  if (rescore_interval > 0) {
+    background.reset(new rescorer<W>());
+  }
+  rescore_snapshot<W> snapshot;
+  shared_ptr<const rescore_result> applied_rescore;
+  vector<uint32_t> graph_versions(num_graphs, 0);
+  uint32_t last_rescore_edge = 0;
+  uint32_t num_rescores = 0;
+  uint64_t num_rescored_graphs = 0;
+  auto submit_rescore = [&]() {
+    // a busy thread would discard the snapshot, retry at the next batch
+    if (!background->idle())
+      return;
+    snapshot.edge_num = edge_num;
+    snapshot.gids.clear();
+    snapshot.versions.clear();
+    snapshot.clusters.clear();
+    snapshot.graph_sketches.clear();
+    for (uint32_t gid = 0; gid < num_graphs; gid++) {
+      if (cluster_map[gid] == UNSEEN)
+        continue;
+      snapshot.gids.push_back(gid);
+      snapshot.versions.push_back(graph_versions[gid]);
+      snapshot.clusters.push_back(cluster_map[gid]);
+      snapshot.graph_sketches.push_back(
+        refresh_sketch(streamhash_sketches[gid], streamhash_projections[gid]));
+    }
+    snapshot.centroid_sketches.resize(centroid_sketches.size());
+    snapshot.active.resize(centroid_sketches.size());
+    for (uint32_t c = 0; c < centroid_sketches.size(); c++) {
+      snapshot.centroid_sketches[c] =
+        refresh_sketch(centroid_sketches[c], centroid_projections[c]);
+      snapshot.active[c] = cluster_sizes[c] > 0;
+    }
+    if (background->submit(snapshot)) {
+      last_rescore_edge = edge_num;
+    }
+  };
+  auto apply_rescore = [&]() {
+    auto result = background->latest();
+    if (result == applied_rescore)
+      return;
+    applied_rescore = result;
+    num_rescores++;
+    for (uint32_t i = 0; i < result->gids.size(); i++) {
+      auto gid = result->gids[i];
+      if (graph_versions[gid] != result->versions[i])
+        continue;
+      double previous_score = anomaly_scores[gid];
+      anomaly_scores[gid] = result->anomaly_scores[i];
+      if (writer) {
+        fire_anomaly_events(monitor, gid, edge_num, cluster_map[gid],
+                            cluster_map[gid], previous_score,
+                            anomaly_scores[gid], chrono::steady_clock::now());
+      }
+      update_anomaly_index(top_index, gid, anomaly_scores[gid]);
+      num_rescored_graphs++;
+      if (cluster_map[gid] >= 0 &&
+          result->nearest_clusters[i] != cluster_map[gid]) {
+        // another centroid came nearer, search at the next update
+        reset_cluster_schedule(cluster_schedules[gid]);
+      }
+    }
+  };
+
+  // Clusters are spawned from nearby anomalies and merged every
+  // CLUSTER_MAINTENANCE_INTERVAL edges, outside the per-edge updates.
+  vector<cluster_change> cluster_changes;
+  uint32_t last_maintenance_edge = 0;
+  uint32_t num_spawned_clusters = 0;
+  uint32_t num_merged_clusters = 0;
+  auto apply_cluster_changes = [&]() {
+    for (auto& change : cluster_changes) {
+      auto gid = change.gid;
+      reset_cluster_schedule(cluster_schedules[gid]);
+      update_anomaly_index(top_index, gid, anomaly_scores[gid]);
+      if (writer) {
+        fire_anomaly_events(monitor, gid, edge_num, change.previous_cluster,
+                            cluster_map[gid], change.previous_score,
+                            anomaly_scores[gid], chrono::steady_clock::now());
+      }
+      graph_versions[gid]++;
+    }
+    cluster_changes.clear();
+  };
+
+  auto process_batch = [&]() {
+    uint32_t batch_edges = edge_num - batch_start;
+    if (batch_edges == 0)
+      return;
+
+    if (background) {
+      apply_rescore();
+    }
+
+    // hash the batch's chunks, split the time among its edges
+    start = chrono::steady_clock::now();
+    hash_chunk_batch<W>(batch, family);
+    end = chrono::steady_clock::now();
+    diff = chrono::duration_cast<chrono::nanoseconds>(end - start);
+    for (uint32_t i = batch_start; i < edge_num; i++) {
+      sketch_update_times[i] += diff / batch_edges;
+    }
+
+    for (auto& delta : pending_deltas) {
+      auto gid = delta.gid;
+      auto n = delta.edge_num;
+
+      start = chrono::steady_clock::now();
+      if (decay < 1.0) {
+        // forget by decaying the projection, no edges are evicted
+        decay_projection(streamhash_projections[gid], graph_epochs[gid], n,
+                         decay);
+      }
+      vector<int> projection_delta =
+        apply_chunk_delta(delta.incoming_chunks, delta.outgoing_chunks, batch,
+                          streamhash_sketches[gid], streamhash_projections[gid]);
+      end = chrono::steady_clock::now();
+      diff = chrono::duration_cast<chrono::nanoseconds>(end - start);
+      sketch_update_times[n] += diff;
+
+      // update centroids and centroid-graph distances, an evicted graph may
+      // also have moved relative to the centroids. The nearest centroid of
+      // a stable graph is only searched for as scheduled.
+      start = chrono::steady_clock::now();
+      bool search_centroids =
+        schedule_cluster_check(refresh_sketch(streamhash_sketches[gid],
+                                              streamhash_projections[gid]),
+                               cluster_schedules[gid], max_check_interval,
+                               max_check_drift);
+      int previous_cluster = cluster_map[gid];
+      double previous_score = anomaly_scores[gid];
+      bool searched =
+        update_distances_and_clusters(gid, projection_delta,
+                                      streamhash_sketches,
+                                      streamhash_projections,
+                                      centroid_sketches, centroid_projections,
+                                      cluster_sizes, centroid_epochs,
+                                      n, decay, cluster_map,
+                                      anomaly_scores, global_threshold,
+                                      cluster_thresholds, search_centroids,
+                                      use_search_cascade,
+                                      use_centroid_index ? &index : nullptr,
+                                      bounds,
+                                      calibrating ? &calibration : nullptr);
+      if (cluster_map[gid] != previous_cluster) {
+        reset_cluster_schedule(cluster_schedules[gid]);
+      }
+      update_anomaly_index(top_index, gid, anomaly_scores[gid]);
+      if (writer) {
+        fire_anomaly_events(monitor, gid, n, previous_cluster, cluster_map[gid],
+                            previous_score, anomaly_scores[gid],
+                            edge_arrivals[n]);
+      }
+      graph_versions[gid]++;
+      num_cluster_updates++;
+      if (!searched) {
+        num_skipped_searches++;
+      }
+      end = chrono::steady_clock::now();
+      diff = chrono::duration_cast<chrono::nanoseconds>(end - start);
+      cluster_update_times[n] += diff;
+
+      // store current anomaly scores and cluster assignments
+      if (delta.inserted && (n % CLUSTER_UPDATE_INTERVAL == 0 ||
+                             n == num_test_edges - 1)) {
+        anomaly_score_iterations[n/CLUSTER_UPDATE_INTERVAL] = anomaly_scores;
+        cluster_map_iterations[n/CLUSTER_UPDATE_INTERVAL] = cluster_map;
+        top_anomaly_iterations[n/CLUSTER_UPDATE_INTERVAL] =
+          top_anomalies(top_index, num_top_anomalies);
+      }
+    }
+
+    pending_deltas.clear();
+    clear_chunk_batch(batch);
+    batch_start = edge_num;
+
+    if (background && edge_num - last_rescore_edge >= rescore_interval) {
+      submit_rescore();
+    }
+
+    if (calibrating &&
+        edge_num - last_calibration_edge >= RECALIBRATION_INTERVAL) {
+      recalibrate_thresholds(calibration, threshold_quantile,
+                             cluster_thresholds, global_threshold);
+      last_calibration_edge = edge_num;
+      num_recalibrations++;
+    }
+
+    if (spawn_min_graphs > 0 &&
+        edge_num - last_maintenance_edge >= CLUSTER_MAINTENANCE_INTERVAL) {
+      centroid_index<W>* maintained_index =
+        use_centroid_index ? &index : nullptr;
+      num_merged_clusters +=
+        merge_clusters<W>(streamhash_sketches, streamhash_projections,
+                          centroid_sketches, centroid_projections,
+                          cluster_sizes, centroid_epochs, edge_num, decay,
+                          cluster_map, anomaly_scores, cluster_thresholds,
+                          maintained_index, bounds, cluster_changes);
+      apply_cluster_changes();
+      num_spawned_clusters +=
+        spawn_clusters<W>(spawn_min_graphs, cluster_capacity,
+                          streamhash_sketches, streamhash_projections,
+                          graph_epochs, centroid_sketches,
+                          centroid_projections, cluster_sizes,
+                          centroid_epochs, edge_num, decay, cluster_map,
+                          anomaly_scores, global_threshold,
+                          cluster_thresholds, maintained_index, bounds,
+                          calibrating ? &calibration : nullptr,
+                          cluster_changes);
+      apply_cluster_changes();
+      last_maintenance_edge = edge_num;
+    }
+  };
+
+  auto stream_start = chrono::steady_clock::now();
   for (auto& group : groups) {
 
 #ifdef DEBUG
@@ -347,57 +949,94 @@ int main(int argc, char *argv[]) {
 #endif
 
       auto& e = test_edges[gid][off];
+      if (writer) {
+        edge_arrivals[edge_num] = chrono::steady_clock::now();
+      }
 
       //
       // PROCESS EDGE
       //
+      // Graphs are updated right away, but the changed chunks are only
+      // collected here. They are hashed and applied with the rest of the
+      // batch, in the same order, which gives the same results as updating
+      // sketches edge by edge.
+      //
+
+      if (burst_gid != gid) { // an edge of another graph ends the burst
+        flush_burst();
+      }
 
-      // check if cache is full
-      if (cache.size() == cache_size) {
+      if (decay >= 1.0 && cache.size() == cache_size) { // cache is full
         auto& edge_to_evict = cache.front(); // oldest edge at head
+
+        // collect the evicted edge's chunks before it leaves its graph
+        start = chrono::steady_clock::now();
+        vector<chunk_key> incoming_chunks, outgoing_chunks;
+        get_evicted_chunks<K>(edge_to_evict, graphs, reverse_graphs,
+                              chunk_length, chunking,
+                              incoming_chunks, outgoing_chunks);
+        uint32_t evicted_gid = get<F_GID>(edge_to_evict);
+        if (burst_edges > 0 && evicted_gid == burst_gid) {
+          num_cancelled_chunks +=
+            merge_chunk_delta(burst_incoming_chunks, burst_outgoing_chunks,
+                              incoming_chunks, outgoing_chunks);
+        } else {
+          push_delta(evicted_gid, edge_num, false, incoming_chunks,
+                     outgoing_chunks);
+        }
+        end = chrono::steady_clock::now();
+        diff = chrono::duration_cast<chrono::nanoseconds>(end - start);
+        shingle_construction_times[edge_num] += diff;
+
         remove_from_graph(edge_to_evict, graphs);
+        if (K > 1) {
+          remove_from_reverse_graph(edge_to_evict, reverse_graphs);
+        }
         cache.pop_front();
       }
-      cache.push_back(e); // newest edge at tail
+      if (decay >= 1.0) {
+        cache.push_back(e); // newest edge at tail
+      }
 
       // update graph
       start = chrono::steady_clock::now();
       update_graphs(e, graphs);
+      if (K > 1) {
+        update_reverse_graphs(e, reverse_graphs);
+      }
       end = chrono::steady_clock::now();
       diff = chrono::duration_cast<chrono::nanoseconds>(end - start);
       graph_update_times[edge_num] = diff;
 
-      // update sketches
-      chrono::nanoseconds shingle_construction_time;
-      chrono::nanoseconds sketch_update_time;
-      vector<int> projection_delta;
-      tie(projection_delta, shingle_construction_time, sketch_update_time) =
-        update_streamhash_sketches(e, graphs, streamhash_sketches,
-                                   streamhash_projections, chunk_length, H);
-      sketch_update_times[edge_num] = sketch_update_time;
-      shingle_construction_times[edge_num] = shingle_construction_time;
-
-      // update centroids and centroid-graph distances
+      // collect the chunks changed by the new edge
       start = chrono::steady_clock::now();
-      update_distances_and_clusters(gid, projection_delta,
-                                    streamhash_sketches,
-                                    streamhash_projections,
-                                    centroid_sketches, centroid_projections,
-                                    cluster_sizes, cluster_map,
-                                    anomaly_scores, global_threshold,
-                                    cluster_thresholds);
-      end = chrono::steady_clock::now();
-      diff = chrono::duration_cast<chrono::nanoseconds>(end - start);
-      cluster_update_times[edge_num] = diff;
-
-      // store current anomaly scores and cluster assignments
-      if (edge_num % CLUSTER_UPDATE_INTERVAL == 0 ||
+      vector<chunk_key> incoming_chunks, outgoing_chunks;
+      get_inserted_chunks<K>(e, graphs, reverse_graphs, chunk_length, chunking,
+                             incoming_chunks, outgoing_chunks);
+      if (burst_edges == 0) {
+        burst_gid = gid;
+        burst_incoming_chunks.swap(incoming_chunks);
+        burst_outgoing_chunks.swap(outgoing_chunks);
+      } else {
+        num_cancelled_chunks +=
+          merge_chunk_delta(burst_incoming_chunks, burst_outgoing_chunks,
+                            incoming_chunks, outgoing_chunks);
+      }
+      burst_edge_num = edge_num;
+      burst_edges++;
+      if (burst_edges == coalesce ||
+          edge_num % CLUSTER_UPDATE_INTERVAL == 0 ||
           edge_num == num_test_edges - 1) {
-        anomaly_score_iterations[edge_num/CLUSTER_UPDATE_INTERVAL] = anomaly_scores;
-        cluster_map_iterations[edge_num/CLUSTER_UPDATE_INTERVAL] = cluster_map;
+        flush_burst();
       }
+      end = chrono::steady_clock::now();
+      diff = chrono::duration_cast<chrono::nanoseconds>(end - start);
+      shingle_construction_times[edge_num] += diff;
 
       edge_num++;
+      if (edge_num - batch_start == batch_size) {
+        process_batch();
+      }
 
 #ifdef DEBUG
       chrono::nanoseconds last_graph_update_time =
@@ -429,6 +1068,68 @@ int main(int argc, char *argv[]) {
       }
     }
   }
+  flush_burst();
+  process_batch(); // the last, partial batch
+  if (writer) {
+    writer->stop();
+  }
+
+  auto stream_time = chrono::duration_cast<chrono::milliseconds>(
+    chrono::steady_clock::now() - stream_start);
+  if (print_stats) {
+    cout << "Streamed " << edge_num << " edges in " << stream_time.count();
+    cout << "ms (" << edge_num / max(1e-3, stream_time.count() / 1e3);
+    cout << " edges/s, batch size " << batch_size << ")" << endl;
+    if (coalesce > 1) {
+      cout << "Coalesced " << edge_num << " edges into " << num_bursts;
+      cout << " updates, " << num_cancelled_chunks << " chunks cancelled";
+      cout << endl;
+    }
+    if (max_check_interval > 1) {
+      cout << "Skipped " << num_skipped_searches << " of ";
+      cout << num_cluster_updates << " nearest centroid searches" << endl;
+    }
+    if (use_centroid_index) {
+      cout << "Centroid index: " << index.num_full_scans << " of ";
+      cout << index.num_searches << " searches fell back to all ";
+      cout << centroid_sketches.size() << " centroids, ";
+      cout << static_cast<double>(index.num_candidates) /
+              max<uint64_t>(1, index.num_searches);
+      cout << " candidates per search" << endl;
+    }
+    if (background) {
+      cout << "Background rescoring: " << num_rescores;
+      cout << " results applied, ";
+      cout << num_rescored_graphs << " graph scores refreshed" << endl;
+    }
+    if (calibrating) {
+      cout << "Recalibrated thresholds " << num_recalibrations << " times, ";
+      cout << "global threshold " << bootstrap_global_threshold << " -> ";
+      cout << global_threshold << endl;
+    }
+    if (spawn_min_graphs > 0) {
+      uint32_t num_active = count_if(cluster_sizes.begin(),
+                                     cluster_sizes.end(),
+                                     [](uint32_t size) { return size > 0; });
+      cout << "Online clustering: " << num_spawned_clusters << " spawned, ";
+      cout << num_merged_clusters << " merged, " << num_active << " of ";
+      cout << cluster_sizes.size() << " clusters active" << endl;
+    }
+    if (writer) {
+      cout << "Anomaly events: " << num_events_by_kind[EVENT_ANOMALY];
+      cout << " anomaly, " << num_events_by_kind[EVENT_ABOVE] << " above, ";
+      cout << num_events_by_kind[EVENT_BELOW] << " below threshold, ";
+      cout << monitor.num_dropped << " dropped" << endl;
+      cout << "Event latency (edge to write): ";
+      cout << static_cast<double>(writer->total_latency.count()) / 1e3 /
+              max<uint64_t>(1, writer->num_written) << "us mean, ";
+      cout << static_cast<double>(writer->max_latency.count()) / 1e3;
+      cout << "us max" << endl;
+    }
+    cout << "Bound pruning: skipped " << bounds.num_pruned << " of ";
+    cout << bounds.num_distances << " centroid distances in full searches";
+    cout << endl;
+  }
 
   chrono::nanoseconds mean_graph_update_time(0);
   for (auto& t : graph_update_times) {
@@ -464,6 +1165,10 @@ int main(int argc, char *argv[]) {
   cout << "\tCluster update: ";
   cout << static_cast<double>(mean_cluster_update_time.count()) << "us" << endl;
 
+  if (print_stats && chunk_dictionary_enabled()) {
+    cout << "Chunk dictionary size: " << chunk_dictionary_size() << endl;
+  }
+
   // print size of each test graph in memory
   cout << "Test graph sizes: " << endl;
   for (auto& gid : test_gids) {
@@ -489,6 +1194,16 @@ int main(int argc, char *argv[]) {
     cout << endl;
   }
 
+  if (num_top_anomalies > 0) {
+    cout << "Top " << num_top_anomalies << " anomalies (gid,score)" << endl;
+    for (auto& top : top_anomaly_iterations) {
+      for (auto& g : top) {
+        cout << g.first << "," << g.second << " ";
+      }
+      cout << endl;
+    }
+  }
+
 #ifdef DEBUG
   for (uint32_t i = 0; i < num_graphs; i++) {
     cout << "Graph projection " << i << ": ";
@@ -510,7 +1225,7 @@ int main(int argc, char *argv[]) {
   /*cout << "Constructing shingle vectors:" << endl;
   start = chrono::steady_clock::now();
   construct_shingle_vectors(shingle_vectors, shingle_id, graphs,
-                            chunk_length);
+                            chunk_length, chunking);
   end = chrono::steady_clock::now();
   diff = chrono::duration_cast<chrono::nanoseconds>(end - start);
   cout << "\tShingle vector construction (per-graph): ";
@@ -559,31 +1274,137 @@ int main(int argc, char *argv[]) {
   return 0;
 }
 
-void allocate_random_bits(vector<vector<uint64_t>>& H, mt19937_64& prng,
-                          uint32_t chunk_length) {
-  // allocate random bits for hashing
-  for (uint32_t i = 0; i < L; i++) {
-    // hash function h_i \in H
-    H[i] = vector<uint64_t>(chunk_length + 2);
-    for (uint32_t j = 0; j < chunk_length + 2; j++) {
-      // random number m_j of h_i
-      H[i][j] = prng();
+int main(int argc, char *argv[]) {
+  // arguments
+  map<string, docopt::value> args = docopt::docopt(USAGE, { argv + 1, argv + argc });
+
+  if (args["--isa"]) {
+    string isa_option = args["--isa"].asString();
+    isa_level isa;
+    if (!parse_isa(isa_option, isa)) {
+      cout << "Invalid instruction set: " << isa_option << ". ";
+      cout << "Should be 'scalar' | 'avx2' | 'avx512'." << endl;
+      exit(-1);
+    } else if (isa > detect_isa()) {
+      cout << "Instruction set not supported by this CPU: " << isa_option;
+      cout << ". Should be at most " << isa_name(detect_isa()) << "." << endl;
+      exit(-1);
     }
+    set_kernel_isa(isa);
   }
-#ifdef DEBUG
-    cout << "64-bit random numbers:\n";
-    for (int i = 0; i < L; i++) {
-      for (int j = 0; j < chunk_length + 2; j++) {
-        cout << H[i][j] << " ";
+
+  long sketch_width = L;
+  if (args["--sketch-width"]) {
+    sketch_width = args["--sketch-width"].asLong();
+  }
+
+  // run the instantiation for the chosen width
+#define RUN_STREAMSPOT(W) \
+  case W: return run_streamspot<W>(args);
+  switch (sketch_width) {
+    FOR_EACH_SKETCH_WIDTH(RUN_STREAMSPOT)
+  }
+#undef RUN_STREAMSPOT
+
+  cout << "Unsupported sketch width: " << sketch_width << ". ";
+  cout << "Should be one of:";
+#define PRINT_SKETCH_WIDTH(W) cout << " " << W;
+  FOR_EACH_SKETCH_WIDTH(PRINT_SKETCH_WIDTH)
+#undef PRINT_SKETCH_WIDTH
+  cout << "." << endl;
+  exit(-1);
+}
+
+/* Speed and accuracy of each hash family with sketches of width W, on the
+ * training graphs. Chunks are hashed one at a time with hash_chunk and
+ * together with hash_chunk_batch, graphs are sketched from their shingle
+ * vectors, and the cosine estimated from every pair of sketches is compared
+ * with the exact cosine of the shingle vectors. Runs on one thread.
+ */
+template<uint32_t W>
+void benchmark_hash_families(const vector<graph>& graphs,
+                             const vector<uint32_t>& train_gid_list,
+                             uint32_t chunk_length, chunking_mode chunking) {
+  vector<unordered_map<chunk_key,uint32_t>> shingle_vectors;
+  unordered_set<chunk_key> distinct_chunks;
+  uint64_t total_shingles = 0;
+  for (auto& gid : train_gid_list) {
+    shingle_vectors.push_back(
+      construct_temp_shingle_vector(graphs[gid], chunk_length, chunking));
+    for (auto& kv : shingle_vectors.back()) {
+      distinct_chunks.insert(kv.first);
+    }
+    total_shingles += shingle_vectors.back().size();
+  }
+  vector<chunk_key> chunks(distinct_chunks.begin(), distinct_chunks.end());
+
+  uint32_t n = shingle_vectors.size();
+  vector<double> exact_cosines;
+  for (uint32_t i = 0; i < n; i++) {
+    for (uint32_t j = i + 1; j < n; j++) {
+      exact_cosines.push_back(cosine_similarity(shingle_vectors[i],
+                                                shingle_vectors[j]));
+    }
+  }
+
+  cout << "Benchmarking hash families on " << n << " training graphs, ";
+  cout << chunks.size() << " distinct chunks:" << endl;
+
+  for (hash_family_kind kind : { HASH_MULTILINEAR, HASH_TABULATION }) {
+    mt19937_64 prng(SEED); // same draws as a run with this family
+    hash_family family = make_hash_family(kind, W, chunk_length, prng);
+
+    // per-chunk hashing
+    auto start = chrono::steady_clock::now();
+    for (auto& chunk : chunks) {
+      hash_chunk<W>(chunk, family);
+    }
+    chrono::duration<double> chunk_time = chrono::steady_clock::now() - start;
+
+    // batched hashing, as when streaming
+    chunk_batch batch;
+    add_to_chunk_batch(batch, chunks);
+    start = chrono::steady_clock::now();
+    hash_chunk_batch<W>(batch, family);
+    chrono::duration<double> batch_time = chrono::steady_clock::now() - start;
+
+    vector<sign_sketch<W>> sketches(n);
+    vector<double> projection;
+    start = chrono::steady_clock::now();
+    for (uint32_t i = 0; i < n; i++) {
+      tie(sketches[i], projection) =
+        construct_streamhash_sketch<W>(shingle_vectors[i], family);
+    }
+    chrono::duration<double> sketch_time = chrono::steady_clock::now() - start;
+
+    double total_error = 0.0, max_error = 0.0;
+    uint32_t pair = 0;
+    for (uint32_t i = 0; i < n; i++) {
+      for (uint32_t j = i + 1; j < n; j++) {
+        double estimate =
+          cos(PI*(1.0 - streamhash_similarity(sketches[i], sketches[j])));
+        double error = fabs(estimate - exact_cosines[pair++]);
+        total_error += error;
+        max_error = max(max_error, error);
       }
-      cout << endl;
     }
-#endif
+
+    cout << "\t" << hash_family_name(kind) << ": ";
+    cout << chunks.size() / max(1e-9, chunk_time.count()) << " chunks/s, ";
+    cout << chunks.size() / max(1e-9, batch_time.count());
+    cout << " chunks/s batched, ";
+    cout << total_shingles / max(1e-9, sketch_time.count());
+    cout << " shingles/s sketched, cosine error ";
+    cout << (pair > 0 ? total_error / pair : 0.0) << " mean ";
+    cout << max_error << " max, ";
+    cout << (family.H.size() * (chunk_length + 2) + family.tables.size()) *
+            sizeof(uint64_t) / 1024 << " KB" << endl;
+  }
 }
 
 void compute_similarities(const vector<shingle_vector>& shingle_vectors,
                           const vector<bitset<L>>& simhash_sketches,
-                          const vector<bitset<L>>& streamhash_sketches) {
+                          const vector<sign_sketch<L>>& streamhash_sketches) {
   for (uint32_t i = 0; i < shingle_vectors.size(); i++) {
     for (uint32_t j = 0; j < shingle_vectors.size(); j++) {
       double cosine = cosine_similarity(shingle_vectors[i],
@@ -647,21 +1468,25 @@ void construct_simhash_sketches(const vector<shingle_vector>& shingle_vectors,
 
 void perform_lsh_banding(const vector<uint32_t>& normal_gids,
                          const vector<bitset<L>>& simhash_sketches,
-                         vector<unordered_map<bitset<R>,vector<uint32_t>>>&
-                            hash_tables) {
+                         vector<band_table>& hash_tables) {
   // LSH-banding: assign graphs to hashtable buckets
+  uint64_t words[SKETCH_WORDS(L)];
   for (auto& gid : normal_gids) {
-    hash_bands(gid, simhash_sketches[gid], hash_tables);
+    simhash_sketch_words(simhash_sketches[gid], words);
+    hash_bands(gid, words, SKETCH_WORDS(L), hash_tables);
   }
 #ifdef DEBUG
   cout << "Hash tables after hashing bands:\n";
   for (uint32_t i = 0; i < B; i++) {
     cout << "\tHash table " << i << ":\n";
-    for (auto& kv : hash_tables[i]) {
+    auto& entries = hash_tables[i].entries;
+    for (auto& slot : hash_tables[i].slots) {
+      if (slot.head == NO_BAND_ENTRY)
+        continue;
       // print graph id's in this bucket
       cout << "\t\tBucket => ";
-      for (uint32_t j = 0; j < kv.second.size(); j++) {
-        cout << kv.second[j] << " ";
+      for (uint32_t e = slot.head; e != NO_BAND_ENTRY; e = entries[e].next) {
+        cout << entries[e].gid << " ";
       }
       cout << endl;
     }
@@ -671,8 +1496,7 @@ void perform_lsh_banding(const vector<uint32_t>& normal_gids,
 
 void print_lsh_clusters(const vector<uint32_t>& normal_gids,
                         const vector<bitset<L>>& simhash_sketches,
-                        const vector<unordered_map<bitset<R>,vector<uint32_t>>>&
-                            hash_tables) {
+                        const vector<band_table>& hash_tables) {
   unordered_set<uint32_t> graphs(normal_gids.size());
   for (auto& gid : normal_gids) {
     graphs.insert(gid);
@@ -691,7 +1515,9 @@ void print_lsh_clusters(const vector<uint32_t>& normal_gids,
       cluster.insert(g);
 
       unordered_set<uint32_t> shared_bucket_graphs;
-      get_shared_bucket_graphs(simhash_sketches[g], hash_tables,
+      uint64_t words[SKETCH_WORDS(L)];
+      simhash_sketch_words(simhash_sketches[g], words);
+      get_shared_bucket_graphs(words, SKETCH_WORDS(L), hash_tables,
                                shared_bucket_graphs);
 
 #ifdef DEBUG
@@ -722,14 +1548,15 @@ void print_lsh_clusters(const vector<uint32_t>& normal_gids,
 
 void test_anomalies(uint32_t num_graphs,
                     const vector<bitset<L>>& simhash_sketches,
-                    const vector<unordered_map<bitset<R>,vector<uint32_t>>>&
-                      hash_tables) {
+                    const vector<band_table>& hash_tables) {
   // for each attack graph, hash it to the B hash tables
   // if any bucket hashed to contains a graph, the attack is not an anomaly
   // otherwise, the graph is isolated, and is an anomaly
+  uint64_t words[SKETCH_WORDS(L)];
   for (uint32_t gid = 0; gid < num_graphs; gid++) {
     cout << gid << "\t";
-    if (is_isolated(simhash_sketches[gid], hash_tables)) {
+    simhash_sketch_words(simhash_sketches[gid], words);
+    if (is_isolated(words, SKETCH_WORDS(L), hash_tables)) {
       cout << "T" << endl;
     } else {
       cout << "F" << endl;
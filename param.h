@@ -10,15 +10,35 @@
 #define NDEBUG            0
 #endif
 
-#define K                 1
+#define K                 1          // shingle hops, K = 1 is specialized
 #define B                 100
 #define R                 20
 #define BUF_SIZE          50
 #define DELIMITER         '\t'
-#define L                 1000       // must be = B * R
+#define L                 1000       // default sketch width, must be = B * R
 #define SEED              23
 #define CLUSTER_UPDATE_INTERVAL   10000
+#define CENTROID_BAND_BITS        12 // bits per band of the centroid index
+#define CENTROID_DRIFT_FRACTION   16 // a centroid moving over W / fraction bits
+                                     // has its pairwise distances recomputed
+#define CASCADE_BLOCK_BITS        256 // sketch bits compared at a time in
+                                      // searches, see sketch_distance_below;
+                                      // 128 was slower, see README
+#define EVENT_QUEUE_CAPACITY      65536 // anomaly events waiting to be written
+#define QUANTILE_SKETCH_K         32 // values per level of a quantile sketch
+#define QUANTILE_SKETCH_LEVELS    10 // levels of a quantile sketch
+#define QUANTILE_MIN_WEIGHT       32 // distances needed to set a threshold
+#define RECALIBRATION_INTERVAL    10000 // edges between threshold updates
+#define CLUSTER_MAINTENANCE_INTERVAL 10000 // edges between cluster spawns
+                                         // and merges
+#define MAX_SPAWNED_CLUSTERS      256 // clusters beyond the bootstrap ones
+#define CLUSTER_MERGE_DISTANCE    0.01 // centroids this near are merged
 
 #define PI                3.1415926535897
 
+// Sketch widths compiled into the binary, selected with --sketch-width. The
+// sketch engine is instantiated once per width, so loops and arrays keep
+// compile-time sizes. Banding (B, R) and Simhash only use the default L.
+#define FOR_EACH_SKETCH_WIDTH(f) f(256) f(512) f(1000) f(2048)
+
 #endif
@@ -0,0 +1,130 @@
+/*
+ * Copyright 2016 Emaad Ahmed Manzoor
+ * License: Apache License, Version 2.0
+ * http://www3.cs.stonybrook.edu/~emanzoor/streamspot/
+ */
+
+#include <algorithm>
+#include "param.h"
+#include "quantile.h"
+#include <utility>
+#include <vector>
+
+namespace std {
+
+void clear_quantile_sketch(quantile_sketch& sketch) {
+  fill(sketch.sizes, sketch.sizes + QUANTILE_SKETCH_LEVELS, 0);
+  sketch.offsets = 0;
+}
+
+// Halves full level i into level up, which is i + 1 or i itself for the top.
+static void compact_level(quantile_sketch& sketch, uint32_t i, uint32_t up) {
+  float* values = sketch.values[i];
+  sort(values, values + QUANTILE_SKETCH_K);
+  uint32_t offset = (sketch.offsets >> i) & 1;
+  sketch.offsets ^= 1u << i;
+
+  // the top level is overwritten in place, behind the values read
+  sketch.sizes[i] = 0;
+  for (uint32_t j = offset; j < QUANTILE_SKETCH_K; j += 2) {
+    sketch.values[up][sketch.sizes[up]++] = values[j];
+  }
+}
+
+void add_to_quantile_sketch(quantile_sketch& sketch, float value) {
+  sketch.values[0][sketch.sizes[0]++] = value;
+  for (uint32_t i = 0;
+       i < QUANTILE_SKETCH_LEVELS && sketch.sizes[i] == QUANTILE_SKETCH_K;
+       i++) {
+    compact_level(sketch, i, min<uint32_t>(i + 1, QUANTILE_SKETCH_LEVELS - 1));
+  }
+}
+
+// Number of values the sketch stands for.
+double quantile_sketch_weight(const quantile_sketch& sketch) {
+  double weight = 0.0;
+  for (uint32_t i = 0; i < QUANTILE_SKETCH_LEVELS; i++) {
+    weight += static_cast<double>(sketch.sizes[i]) * (1u << i);
+  }
+  return weight;
+}
+
+// The q-quantile of the values of both sketches together.
+double sketch_quantile(const quantile_sketch& sketch1,
+                       const quantile_sketch& sketch2, double q) {
+  vector<pair<float,uint32_t>> weighted;
+  for (auto sketch : { &sketch1, &sketch2 }) {
+    for (uint32_t i = 0; i < QUANTILE_SKETCH_LEVELS; i++) {
+      for (uint32_t j = 0; j < sketch->sizes[i]; j++) {
+        weighted.push_back(make_pair(sketch->values[i][j], 1u << i));
+      }
+    }
+  }
+  if (weighted.empty())
+    return 0.0;
+  sort(weighted.begin(), weighted.end());
+
+  double total = quantile_sketch_weight(sketch1) +
+                 quantile_sketch_weight(sketch2);
+  double rank = 0.0;
+  for (auto& w : weighted) {
+    rank += w.second;
+    if (rank >= q * total)
+      return w.first;
+  }
+  return weighted.back().first;
+}
+
+void init_threshold_calibration(threshold_calibration& calibration,
+                                uint32_t nclusters) {
+  calibration.current.resize(nclusters);
+  calibration.previous.resize(nclusters);
+  for (uint32_t c = 0; c < nclusters; c++) {
+    clear_quantile_sketch(calibration.current[c]);
+    clear_quantile_sketch(calibration.previous[c]);
+  }
+  clear_quantile_sketch(calibration.global_current);
+  clear_quantile_sketch(calibration.global_previous);
+}
+
+// Records the distance of a graph to the centroid of cluster, its nearest.
+void record_cluster_distance(threshold_calibration& calibration,
+                             uint32_t cluster, double distance) {
+  add_to_quantile_sketch(calibration.current[cluster], distance);
+  add_to_quantile_sketch(calibration.global_current, distance);
+}
+
+/* Sets the thresholds to the q-quantile of the distances recorded over the
+ * last two intervals, for the clusters with at least QUANTILE_MIN_WEIGHT of
+ * them, and starts a new interval. Returns the number of thresholds set,
+ * counting the global threshold.
+ */
+uint32_t recalibrate_thresholds(threshold_calibration& calibration, double q,
+                                vector<double>& cluster_thresholds,
+                                double& global_threshold) {
+  uint32_t num_set = 0;
+  for (uint32_t c = 0; c < cluster_thresholds.size(); c++) {
+    auto& current = calibration.current[c];
+    auto& previous = calibration.previous[c];
+    if (quantile_sketch_weight(current) + quantile_sketch_weight(previous) >=
+        QUANTILE_MIN_WEIGHT) {
+      cluster_thresholds[c] = sketch_quantile(current, previous, q);
+      num_set++;
+    }
+    previous = current;
+    clear_quantile_sketch(current);
+  }
+
+  auto& current = calibration.global_current;
+  auto& previous = calibration.global_previous;
+  if (quantile_sketch_weight(current) + quantile_sketch_weight(previous) >=
+      QUANTILE_MIN_WEIGHT) {
+    global_threshold = sketch_quantile(current, previous, q);
+    num_set++;
+  }
+  previous = current;
+  clear_quantile_sketch(current);
+  return num_set;
+}
+
+}
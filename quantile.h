@@ -0,0 +1,61 @@
+/*
+ * Copyright 2016 Emaad Ahmed Manzoor
+ * License: Apache License, Version 2.0
+ * http://www3.cs.stonybrook.edu/~emanzoor/streamspot/
+ */
+
+#ifndef STREAMSPOT_QUANTILE_H_
+#define STREAMSPOT_QUANTILE_H_
+
+#include "param.h"
+#include <cstdint>
+#include <vector>
+
+namespace std {
+
+static_assert(QUANTILE_SKETCH_K % 2 == 0 && QUANTILE_SKETCH_K < 256,
+              "levels are halved and their sizes are 8-bit");
+static_assert(QUANTILE_SKETCH_LEVELS <= 32, "offsets are 32-bit");
+
+/* KLL-style quantile sketch: level i holds up to QUANTILE_SKETCH_K values,
+ * each standing for 2^i of the values added. A full level is sorted and
+ * every other value, starting at alternate ends, moves up a level, so adding
+ * a value takes O(1) amortized time and the sketch keeps a fixed size,
+ * 1.3KB with the default parameters. The top level is compacted into
+ * itself, which halves the weight of the oldest values once it is full.
+ */
+struct quantile_sketch {
+  float values[QUANTILE_SKETCH_LEVELS][QUANTILE_SKETCH_K];
+  uint8_t sizes[QUANTILE_SKETCH_LEVELS];
+  uint32_t offsets;                        // bit i: next compaction of level
+                                           // i keeps the odd positions
+};
+
+/* Quantile sketches of the distances of graphs to each cluster's centroid
+ * when it is their nearest, and of all of them, over the current and the
+ * previous recalibration interval. Thresholds follow the distances of the
+ * last one to two intervals, so they drift with normal behaviour.
+ */
+struct threshold_calibration {
+  vector<quantile_sketch> current;         // by cluster
+  vector<quantile_sketch> previous;
+  quantile_sketch global_current;
+  quantile_sketch global_previous;
+};
+
+void clear_quantile_sketch(quantile_sketch& sketch);
+void add_to_quantile_sketch(quantile_sketch& sketch, float value);
+double quantile_sketch_weight(const quantile_sketch& sketch);
+double sketch_quantile(const quantile_sketch& sketch1,
+                       const quantile_sketch& sketch2, double q);
+void init_threshold_calibration(threshold_calibration& calibration,
+                                uint32_t nclusters);
+void record_cluster_distance(threshold_calibration& calibration,
+                             uint32_t cluster, double distance);
+uint32_t recalibrate_thresholds(threshold_calibration& calibration, double q,
+                                vector<double>& cluster_thresholds,
+                                double& global_threshold);
+
+}
+
+#endif
@@ -0,0 +1,127 @@
+/*
+ * Copyright 2016 Emaad Ahmed Manzoor
+ * License: Apache License, Version 2.0
+ * http://www3.cs.stonybrook.edu/~emanzoor/streamspot/
+ */
+
+#include <cmath>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include "param.h"
+#include "rescore.h"
+#include "streamhash.h"
+#include <thread>
+#include <vector>
+
+namespace std {
+
+template<uint32_t W>
+rescorer<W>::rescorer() : busy(false), stopping(false) {
+  worker = thread(&rescorer<W>::worker_loop, this);
+}
+
+template<uint32_t W>
+rescorer<W>::~rescorer() {
+  {
+    lock_guard<mutex> lock(m);
+    stopping = true;
+  }
+  cv.notify_all();
+  worker.join();
+}
+
+// Whether the thread would take a snapshot now.
+template<uint32_t W>
+bool rescorer<W>::idle() {
+  lock_guard<mutex> lock(m);
+  return !busy;
+}
+
+// Hands the snapshot to the thread, leaving an old one in its place for
+// reuse. Returns false, leaving the snapshot as is, if the thread is busy.
+template<uint32_t W>
+bool rescorer<W>::submit(rescore_snapshot<W>& snapshot) {
+  {
+    lock_guard<mutex> lock(m);
+    if (busy)
+      return false;
+    swap(pending, snapshot);
+    busy = true;
+  }
+  cv.notify_one();
+  return true;
+}
+
+// The most recent result, null until the first one.
+template<uint32_t W>
+shared_ptr<const rescore_result> rescorer<W>::latest() const {
+  return atomic_load(&published);
+}
+
+template<uint32_t W>
+void rescorer<W>::worker_loop() {
+  while (true) {
+    {
+      unique_lock<mutex> lock(m);
+      cv.wait(lock, [this]{ return stopping || busy; });
+      if (stopping)
+        return;
+    }
+
+    // submit leaves pending alone while busy
+    auto result = make_shared<const rescore_result>(rescore_graphs(pending));
+    atomic_store(&published, result);
+
+    lock_guard<mutex> lock(m);
+    busy = false;
+  }
+}
+
+// Distances of every graph to its own and its nearest active centroid, the
+// first if tied, with one batched popcount kernel call per graph.
+template<uint32_t W>
+rescore_result rescore_graphs(const rescore_snapshot<W>& snapshot) {
+  uint32_t num_graphs = snapshot.gids.size();
+  uint32_t nclusters = snapshot.centroid_sketches.size();
+  rescore_result result;
+  result.edge_num = snapshot.edge_num;
+  result.gids = snapshot.gids;
+  result.versions = snapshot.versions;
+  result.anomaly_scores.resize(num_graphs);
+  result.nearest_clusters.resize(num_graphs);
+  result.nearest_distances.resize(num_graphs);
+
+  vector<uint32_t> distances(nclusters);
+  for (uint32_t i = 0; i < num_graphs; i++) {
+    sketch_distances(snapshot.graph_sketches[i],
+                     snapshot.centroid_sketches.data(), nclusters,
+                     distances.data());
+    uint32_t nearest = 0;
+    for (uint32_t c = 1; c < nclusters; c++) {
+      if (snapshot.active[c] &&
+          (!snapshot.active[nearest] || distances[c] < distances[nearest])) {
+        nearest = c;
+      }
+    }
+
+    // anomaly score is a "distance", as in update_distances_and_clusters
+    auto distance = [&](uint32_t c) {
+      return 1.0 - cos(PI*(1.0 - static_cast<double>(W - distances[c]) / W));
+    };
+    int cluster = snapshot.clusters[i];
+    result.nearest_clusters[i] = nearest;
+    result.nearest_distances[i] = distance(nearest);
+    result.anomaly_scores[i] = cluster >= 0 ? distance(cluster)
+                                            : result.nearest_distances[i];
+  }
+  return result;
+}
+
+#define INSTANTIATE_RESCORE(W) \
+  template class rescorer<W>; \
+  template rescore_result \
+    rescore_graphs<W>(const rescore_snapshot<W>& snapshot);
+FOR_EACH_SKETCH_WIDTH(INSTANTIATE_RESCORE)
+
+}
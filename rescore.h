@@ -0,0 +1,79 @@
+/*
+ * Copyright 2016 Emaad Ahmed Manzoor
+ * License: Apache License, Version 2.0
+ * http://www3.cs.stonybrook.edu/~emanzoor/streamspot/
+ */
+
+#ifndef STREAMSPOT_RESCORE_H_
+#define STREAMSPOT_RESCORE_H_
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include "param.h"
+#include "streamhash.h"
+#include <thread>
+#include <vector>
+
+namespace std {
+
+// live graphs and the centroids, copied from the streaming state
+template<uint32_t W>
+struct rescore_snapshot {
+  uint32_t edge_num;                       // edges streamed when taken
+  vector<uint32_t> gids;
+  vector<uint32_t> versions;               // updates of each graph so far
+  vector<int> clusters;                    // cluster of each graph, or ANOMALY
+  vector<sign_sketch<W>> graph_sketches;   // all up to date
+  vector<sign_sketch<W>> centroid_sketches;
+  vector<uint8_t> active;                  // clusters not retired
+};
+
+// scores of a snapshot's graphs, in the same order
+struct rescore_result {
+  uint32_t edge_num;
+  vector<uint32_t> gids;
+  vector<uint32_t> versions;
+  vector<double> anomaly_scores;           // to the graph's own centroid, or
+                                           // the nearest for anomalies
+  vector<int> nearest_clusters;
+  vector<double> nearest_distances;
+};
+
+/* Rescores snapshots of the live graphs on a background thread.
+ *
+ * submit swaps a snapshot in unless the previous one is still being
+ * rescored, and never waits for the thread. Only the thread clears busy, so
+ * a snapshot submitted by the caller of idle after it returned true is
+ * always taken: check idle first to skip copying a snapshot for nothing. Results are published with an
+ * atomic store of a shared_ptr, so latest never waits either, and a result
+ * is never seen half written.
+ */
+template<uint32_t W>
+class rescorer {
+ public:
+  rescorer();
+  ~rescorer();
+
+  bool idle();
+  bool submit(rescore_snapshot<W>& snapshot);
+  shared_ptr<const rescore_result> latest() const;
+
+ private:
+  void worker_loop();
+
+  thread worker;
+  mutex m;
+  condition_variable cv;               // signals a snapshot or shutdown
+  rescore_snapshot<W> pending;
+  bool busy;                           // pending is being rescored
+  bool stopping;
+  shared_ptr<const rescore_result> published;
+};
+
+template<uint32_t W>
+rescore_result rescore_graphs(const rescore_snapshot<W>& snapshot);
+
+}
+
+#endif
@@ -7,6 +7,7 @@
 #include <bitset>
 #include "param.h"
 #include "simhash.h"
+#include "streamhash.h"
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -31,4 +32,12 @@ double simhash_similarity(const bitset<L>& sketch1, const bitset<L>& sketch2) {
   return static_cast<double>((~(sketch1 ^ sketch2)).count()) / L;
 }
 
+// The sketch as SKETCH_WORDS(L) words, laid out like a sign_sketch<L>.
+void simhash_sketch_words(const bitset<L>& sketch, uint64_t* words) {
+  const bitset<L> mask(~0ull);
+  for (uint32_t w = 0; w < SKETCH_WORDS(L); w++) {
+    words[w] = ((sketch >> (64 * w)) & mask).to_ullong();
+  }
+}
+
 }
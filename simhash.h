@@ -20,6 +20,7 @@ void construct_simhash_sketch(bitset<L>& simhash_sketch,
                               const shingle_vector& sv,
                               const vector<vector<int>>& random_vectors);
 double simhash_similarity(const bitset<L>& sketch1, const bitset<L>& sketch2);
+void simhash_sketch_words(const bitset<L>& sketch, uint64_t* words);
 
 }
 #endif
@@ -4,40 +4,833 @@
  * http://www3.cs.stonybrook.edu/~emanzoor/streamspot/
  */
 
+#include <algorithm>
 #include <bitset>
-#include "hash.h"
+#include "chunk.h"
+#include <cmath>
+#include <iostream>
+#include "isa.h"
 #include "param.h"
 #include "streamhash.h"
 #include <tuple>
 #include <unordered_map>
 #include <vector>
 
+#if defined(__SSE2__) || defined(ISA_DISPATCH)
+#include <immintrin.h>
+#endif
+
 namespace std {
 
-double streamhash_similarity(const bitset<L>& sketch1, const bitset<L>& sketch2) {
-  // XOR = 0 if bits are the same, 1 otherwise
-  return static_cast<double>((~(sketch1 ^ sketch2)).count()) / L;
+#define HASH_TILE     64  // hash functions per tile of the blocked kernel
+#define SHINGLE_BLOCK 256 // shingles per block of the blocked kernel
+
+// Sign bits of components i to n - 1 of the 64 components at p.
+static ALWAYS_INLINE uint64_t sign_bits(const double* p, uint32_t i,
+                                        uint32_t n) {
+  uint64_t word = 0;
+  for (; i < n; i++) {
+    word |= static_cast<uint64_t>(p[i] >= 0) << i;
+  }
+  return word;
+}
+
+// Sign bits of W projection components, see sign_sketch. Comparisons are
+// done a vector register at a time and turned into bits with a mask: two
+// components at a time with SSE2, four with AVX2 and eight with AVX-512.
+template<uint32_t W>
+static void compute_sign_words_scalar(const double* projection,
+                                      uint64_t* words) {
+  for (uint32_t w = 0; w < SKETCH_WORDS(W); w++) {
+    const double* p = projection + w * 64;
+    uint32_t n = min(64u, W - w * 64);
+    uint64_t word = 0;
+    uint32_t i = 0;
+#if defined(__SSE2__)
+    __m128d zero = _mm_setzero_pd();
+    for (; i + 2 <= n; i += 2) {
+      __m128d ge = _mm_cmpge_pd(_mm_loadu_pd(p + i), zero);
+      word |= static_cast<uint64_t>(_mm_movemask_pd(ge)) << i;
+    }
+#endif
+    words[w] = word | sign_bits(p, i, n);
+  }
+}
+
+#ifdef ISA_DISPATCH
+template<uint32_t W>
+static TARGET_AVX2 void compute_sign_words_avx2(const double* projection,
+                                                uint64_t* words) {
+  for (uint32_t w = 0; w < SKETCH_WORDS(W); w++) {
+    const double* p = projection + w * 64;
+    uint32_t n = min(64u, W - w * 64);
+    uint64_t word = 0;
+    uint32_t i = 0;
+    __m256d zero = _mm256_setzero_pd();
+    for (; i + 4 <= n; i += 4) {
+      __m256d ge = _mm256_cmp_pd(_mm256_loadu_pd(p + i), zero, _CMP_GE_OQ);
+      word |= static_cast<uint64_t>(_mm256_movemask_pd(ge)) << i;
+    }
+    words[w] = word | sign_bits(p, i, n);
+  }
+}
+
+template<uint32_t W>
+static TARGET_AVX512 void compute_sign_words_avx512(const double* projection,
+                                                    uint64_t* words) {
+  for (uint32_t w = 0; w < SKETCH_WORDS(W); w++) {
+    const double* p = projection + w * 64;
+    uint32_t n = min(64u, W - w * 64);
+    uint64_t word = 0;
+    uint32_t i = 0;
+    __m512d zero = _mm512_setzero_pd();
+    for (; i + 8 <= n; i += 8) {
+      __mmask8 ge = _mm512_cmp_pd_mask(_mm512_loadu_pd(p + i), zero,
+                                       _CMP_GE_OQ);
+      word |= static_cast<uint64_t>(ge) << i;
+    }
+    words[w] = word | sign_bits(p, i, n);
+  }
+}
+#else
+#define compute_sign_words_avx2   compute_sign_words_scalar
+#define compute_sign_words_avx512 compute_sign_words_scalar
+#endif
+
+template<uint32_t W>
+void compute_sign_words(const double* projection, uint64_t* words) {
+  switch (kernel_isa()) {
+    case ISA_AVX512: compute_sign_words_avx512<W>(projection, words); break;
+    case ISA_AVX2:   compute_sign_words_avx2<W>(projection, words); break;
+    default:         compute_sign_words_scalar<W>(projection, words); break;
+  }
+}
+
+template<uint32_t W>
+sign_sketch<W> make_sign_sketch(const vector<double>& projection) {
+  sign_sketch<W> sketch;
+  compute_sign_words<W>(projection.data(), sketch.words);
+  sketch.dirty = false;
+  return sketch;
+}
+
+// Brings the sketch up to date with its projection if needed.
+template<uint32_t W>
+const sign_sketch<W>& refresh_sketch(sign_sketch<W>& sketch,
+                                     const vector<double>& projection) {
+  if (sketch.dirty) {
+    compute_sign_words<W>(projection.data(), sketch.words);
+    sketch.dirty = false;
+  }
+  return sketch;
+}
+
+// Number of different bits, a POPCNT instruction per word with AVX2 and up.
+template<uint32_t W>
+static ALWAYS_INLINE uint32_t count_different_bits(const uint64_t* words1,
+                                                   const uint64_t* words2) {
+  uint32_t distance = 0;
+  for (uint32_t w = 0; w < SKETCH_WORDS(W); w++) {
+    distance += __builtin_popcountll(words1[w] ^ words2[w]);
+  }
+  return distance;
+}
+
+template<uint32_t W>
+static uint32_t sketch_distance_scalar(const uint64_t* words1,
+                                       const uint64_t* words2) {
+  return count_different_bits<W>(words1, words2);
+}
+
+template<uint32_t W>
+static TARGET_AVX2 uint32_t sketch_distance_avx2(const uint64_t* words1,
+                                                 const uint64_t* words2) {
+  return count_different_bits<W>(words1, words2);
+}
+
+template<uint32_t W>
+static TARGET_AVX512 uint32_t sketch_distance_avx512(const uint64_t* words1,
+                                                     const uint64_t* words2) {
+  return count_different_bits<W>(words1, words2);
+}
+
+// Hamming distance, both sketches must be up to date.
+template<uint32_t W>
+uint32_t sketch_distance(const sign_sketch<W>& sketch1,
+                         const sign_sketch<W>& sketch2) {
+  switch (kernel_isa()) {
+    case ISA_AVX512:
+      return sketch_distance_avx512<W>(sketch1.words, sketch2.words);
+    case ISA_AVX2:
+      return sketch_distance_avx2<W>(sketch1.words, sketch2.words);
+    default:
+      return sketch_distance_scalar<W>(sketch1.words, sketch2.words);
+  }
+}
+
+template<uint32_t W>
+static ALWAYS_INLINE void count_different_bits_many(const uint64_t* words,
+                                                    const sign_sketch<W>* sketches,
+                                                    uint32_t num_sketches,
+                                                    uint32_t* distances) {
+  for (uint32_t i = 0; i < num_sketches; i++) {
+    distances[i] = count_different_bits<W>(words, sketches[i].words);
+  }
+}
+
+template<uint32_t W>
+static void sketch_distances_scalar(const uint64_t* words,
+                                    const sign_sketch<W>* sketches,
+                                    uint32_t num_sketches,
+                                    uint32_t* distances) {
+  count_different_bits_many<W>(words, sketches, num_sketches, distances);
+}
+
+template<uint32_t W>
+static TARGET_AVX2 void sketch_distances_avx2(const uint64_t* words,
+                                              const sign_sketch<W>* sketches,
+                                              uint32_t num_sketches,
+                                              uint32_t* distances) {
+  count_different_bits_many<W>(words, sketches, num_sketches, distances);
+}
+
+template<uint32_t W>
+static TARGET_AVX512 void sketch_distances_avx512(const uint64_t* words,
+                                                  const sign_sketch<W>* sketches,
+                                                  uint32_t num_sketches,
+                                                  uint32_t* distances) {
+  count_different_bits_many<W>(words, sketches, num_sketches, distances);
+}
+
+// Hamming distances of a sketch to num_sketches others, with one dispatch
+// for all of them. All sketches must be up to date.
+template<uint32_t W>
+void sketch_distances(const sign_sketch<W>& sketch,
+                      const sign_sketch<W>* sketches, uint32_t num_sketches,
+                      uint32_t* distances) {
+  switch (kernel_isa()) {
+    case ISA_AVX512:
+      sketch_distances_avx512<W>(sketch.words, sketches, num_sketches,
+                                 distances);
+      break;
+    case ISA_AVX2:
+      sketch_distances_avx2<W>(sketch.words, sketches, num_sketches,
+                               distances);
+      break;
+    default:
+      sketch_distances_scalar<W>(sketch.words, sketches, num_sketches,
+                                 distances);
+      break;
+  }
+}
+
+// count_different_bits a block of words at a time, stopping after the block
+// where the count reaches limit.
+template<uint32_t W>
+static ALWAYS_INLINE uint32_t count_different_bits_below(const uint64_t* words1,
+                                                         const uint64_t* words2,
+                                                         uint32_t limit) {
+  uint32_t distance = 0;
+  for (uint32_t b = 0; b < SKETCH_WORDS(W); b += CASCADE_BLOCK_WORDS) {
+    for (uint32_t w = b; w < b + CASCADE_BLOCK_WORDS && w < SKETCH_WORDS(W);
+         w++) {
+      distance += __builtin_popcountll(words1[w] ^ words2[w]);
+    }
+    if (distance >= limit)
+      break;
+  }
+  return distance;
+}
+
+template<uint32_t W>
+static uint32_t sketch_distance_below_scalar(const uint64_t* words1,
+                                             const uint64_t* words2,
+                                             uint32_t limit) {
+  return count_different_bits_below<W>(words1, words2, limit);
+}
+
+template<uint32_t W>
+static TARGET_AVX2 uint32_t sketch_distance_below_avx2(const uint64_t* words1,
+                                                       const uint64_t* words2,
+                                                       uint32_t limit) {
+  return count_different_bits_below<W>(words1, words2, limit);
+}
+
+template<uint32_t W>
+static TARGET_AVX512 uint32_t
+sketch_distance_below_avx512(const uint64_t* words1, const uint64_t* words2,
+                             uint32_t limit) {
+  return count_different_bits_below<W>(words1, words2, limit);
+}
+
+/* Hamming distance if it is below limit, otherwise some count of at least
+ * limit. Sketches are compared CASCADE_BLOCK_BITS at a time, and the rest
+ * is skipped once the bits compared so far differ in limit places: in a
+ * search, most centroids are ruled out by their first blocks.
+ */
+template<uint32_t W>
+uint32_t sketch_distance_below(const sign_sketch<W>& sketch1,
+                               const sign_sketch<W>& sketch2, uint32_t limit) {
+  switch (kernel_isa()) {
+    case ISA_AVX512:
+      return sketch_distance_below_avx512<W>(sketch1.words, sketch2.words,
+                                             limit);
+    case ISA_AVX2:
+      return sketch_distance_below_avx2<W>(sketch1.words, sketch2.words,
+                                           limit);
+    default:
+      return sketch_distance_below_scalar<W>(sketch1.words, sketch2.words,
+                                             limit);
+  }
+}
+
+template<uint32_t W>
+double streamhash_similarity(const sign_sketch<W>& sketch1,
+                             const sign_sketch<W>& sketch2) {
+  // fraction of equal bits
+  return static_cast<double>(W - sketch_distance(sketch1, sketch2)) / W;
+}
+
+// construct_streamhash_sketch a shingle at a time, with hash_chunk.
+template<uint32_t W>
+static tuple<sign_sketch<W>,vector<double>>
+sum_chunk_hashes(const unordered_map<chunk_key,uint32_t>& shingle_vector,
+                 const hash_family& family) {
+  vector<double> projection(W, 0.0);
+
+  for (auto& kv : shingle_vector) {
+    const uint64_t* bits = hash_chunk<W>(kv.first, family);
+    int count = kv.second;
+    for (uint32_t i = 0; i < W; i++) {
+      projection[i] += count * chunk_hash_bit(bits, i);
+    }
+  }
+
+  return make_tuple(make_sign_sketch<W>(projection), projection);
+}
+
+/* H regrouped for the blocked kernel: tiles of HASH_TILE hash functions, and
+ * within a tile, the random words of all functions for one chunk position
+ * are contiguous. Tile t, position j, function t*HASH_TILE + i is at
+ * ((t * positions) + j) * HASH_TILE + i. The last tile is padded with zeros.
+ * For C = 50 a tile is 26 KB and fits in L1.
+ */
+static vector<uint64_t> tile_hash_family(const vector<vector<uint64_t>>& H) {
+  uint32_t num_functions = H.size();
+  uint32_t positions = H[0].size();
+  uint32_t num_tiles = (num_functions + HASH_TILE - 1) / HASH_TILE;
+  vector<uint64_t> H_tiles(num_tiles * positions * HASH_TILE, 0);
+
+  for (uint32_t f = 0; f < num_functions; f++) {
+    uint32_t t = f / HASH_TILE, i = f % HASH_TILE;
+    for (uint32_t j = 0; j < positions; j++) {
+      H_tiles[(t * positions + j) * HASH_TILE + i] = H[f][j];
+    }
+  }
+
+  return H_tiles;
+}
+
+static void allocate_random_bits(vector<vector<uint64_t>>& H, mt19937_64& prng,
+                                 uint32_t chunk_length) {
+  // allocate random bits for hashing
+  for (uint32_t i = 0; i < H.size(); i++) {
+    // hash function h_i \in H
+    H[i] = vector<uint64_t>(chunk_length + 2);
+    for (uint32_t j = 0; j < chunk_length + 2; j++) {
+      // random number m_j of h_i
+      H[i][j] = prng();
+    }
+  }
+#ifdef DEBUG
+    cout << "64-bit random numbers:\n";
+    for (uint32_t i = 0; i < H.size(); i++) {
+      for (uint32_t j = 0; j < chunk_length + 2; j++) {
+        cout << H[i][j] << " ";
+      }
+      cout << endl;
+    }
+#endif
+}
+
+/* Draws a family of num_functions functions for chunks of up to
+ * chunk_length + 1 characters (content-defined chunks may be one longer).
+ * A multilinear family takes chunk_length + 2 words of prng output per
+ * function, a tabulation family a word per 64 functions and row.
+ */
+hash_family make_hash_family(hash_family_kind kind, uint32_t num_functions,
+                             uint32_t chunk_length, mt19937_64& prng) {
+  hash_family family;
+  family.kind = kind;
+  family.num_functions = num_functions;
+  family.max_length = chunk_length + 1;
+
+  if (kind == HASH_MULTILINEAR) {
+    family.H.resize(num_functions);
+    allocate_random_bits(family.H, prng, chunk_length);
+    family.H_tiles = tile_hash_family(family.H);
+  } else {
+    uint32_t num_words = CHUNK_HASH_WORDS(num_functions);
+    uint32_t num_rows = 1 + family.max_length * 256;
+    family.tables.resize(num_rows * num_words);
+    for (uint32_t r = 0; r < num_rows; r++) {
+      for (uint32_t w = 0; w < num_words; w++) {
+        uint64_t bits = prng();
+        if (num_functions - w * 64 < 64) { // no bits past the last function
+          bits &= (1ull << (num_functions - w * 64)) - 1;
+        }
+        family.tables[r * num_words + w] = bits;
+      }
+    }
+  }
+
+  return family;
+}
+
+const char* hash_family_name(hash_family_kind kind) {
+  return kind == HASH_TABULATION ? "tabulation" : "multilinear";
+}
+
+bool parse_hash_family(const string& name, hash_family_kind& kind) {
+  for (hash_family_kind k : { HASH_MULTILINEAR, HASH_TABULATION }) {
+    if (name.compare(hash_family_name(k)) == 0) {
+      kind = k;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Multilinear hash sums of one chunk for all functions of a tile. The loops
+// over the tile's functions are vectorized by the compiler. For C > 0 the
+// loop over the chunk's characters has a constant bound and is unrolled.
+template<uint32_t C>
+static ALWAYS_INLINE void hash_tile(const uint64_t* tile, const uint8_t* row,
+                                    uint32_t length, uint64_t* sums) {
+  for (uint32_t i = 0; i < HASH_TILE; i++) {
+    sums[i] = tile[i];
+  }
+  for (uint32_t j = 0; j < (C > 0 ? C : length); j++) {
+    if (C > 0 && j == length)
+      break;
+    const uint64_t* randbits = tile + (j + 1) * HASH_TILE;
+    uint64_t c = row[j];
+    for (uint32_t i = 0; i < HASH_TILE; i++) {
+      sums[i] += randbits[i] * c;
+    }
+  }
+}
+
+// Blocked sums of the rows unpacked by construct_streamhash_sketch.
+template<uint32_t C>
+static ALWAYS_INLINE void accumulate_blocks(const uint64_t* H_tiles,
+                                            uint32_t positions,
+                                            uint32_t num_tiles,
+                                            const uint8_t* rows,
+                                            const uint32_t* lengths,
+                                            const int64_t* counts, uint32_t n,
+                                            int64_t* accumulator) {
+  uint32_t width = positions - 1;
+
+  for (uint32_t block = 0; block < n; block += SHINGLE_BLOCK) {
+    uint32_t block_end = min(block + SHINGLE_BLOCK, n);
+
+    for (uint32_t t = 0; t < num_tiles; t++) {
+      const uint64_t* tile = H_tiles + t * positions * HASH_TILE;
+      int64_t* tile_accumulator = &accumulator[t * HASH_TILE];
+
+      for (uint32_t s = block; s < block_end; s++) {
+        uint64_t sums[HASH_TILE];
+        hash_tile<C>(tile, &rows[s * width], lengths[s], sums);
+
+        // add count * (+1 if the MSB is set, else -1)
+        int64_t count = counts[s];
+        for (uint32_t i = 0; i < HASH_TILE; i++) {
+          int64_t sign = static_cast<int64_t>(sums[i] >> 63) * 2 - 1;
+          tile_accumulator[i] += sign * count;
+        }
+      }
+    }
+  }
+}
+
+// accumulate_blocks for the chunk length of H_tiles, compiled for each
+// instruction set
+static void accumulate_blocks_scalar(const uint64_t* H_tiles,
+                                     uint32_t positions, uint32_t num_tiles,
+                                     const uint8_t* rows,
+                                     const uint32_t* lengths,
+                                     const int64_t* counts, uint32_t n,
+                                     int64_t* accumulator) {
+  DISPATCH_CHUNK_LENGTH(positions - 2, accumulate_blocks, H_tiles, positions,
+                        num_tiles, rows, lengths, counts, n, accumulator);
 }
 
-tuple<bitset<L>,vector<int>>
-construct_streamhash_sketch(const unordered_map<string,uint32_t>& shingle_vector,
-                            const vector<vector<uint64_t>>& H) {
-  bitset<L> sketch;
-  vector<int> projection(L, 0);
+static TARGET_AVX2 void accumulate_blocks_avx2(const uint64_t* H_tiles,
+                                               uint32_t positions,
+                                               uint32_t num_tiles,
+                                               const uint8_t* rows,
+                                               const uint32_t* lengths,
+                                               const int64_t* counts,
+                                               uint32_t n,
+                                               int64_t* accumulator) {
+  DISPATCH_CHUNK_LENGTH(positions - 2, accumulate_blocks, H_tiles, positions,
+                        num_tiles, rows, lengths, counts, n, accumulator);
+}
+
+static TARGET_AVX512 void accumulate_blocks_avx512(const uint64_t* H_tiles,
+                                                   uint32_t positions,
+                                                   uint32_t num_tiles,
+                                                   const uint8_t* rows,
+                                                   const uint32_t* lengths,
+                                                   const int64_t* counts,
+                                                   uint32_t n,
+                                                   int64_t* accumulator) {
+  DISPATCH_CHUNK_LENGTH(positions - 2, accumulate_blocks, H_tiles, positions,
+                        num_tiles, rows, lengths, counts, n, accumulator);
+}
+
+/* Blocked version of construct_streamhash_sketch for whole graphs.
+ *
+ * The shingle vector times the hash family is computed as a blocked matrix
+ * product: shingles are unpacked once into a byte matrix, and for each block
+ * of SHINGLE_BLOCK shingles, every tile of HASH_TILE hash functions is
+ * applied to the whole block, so the tile stays in L1 while the block stays
+ * in L2. The innermost loops run over the functions of a tile and are
+ * vectorized by the compiler. Projections are accumulated as integers, so
+ * the result is identical to the per-shingle version.
+ *
+ * Memoized hashes are cheaper than recomputing them, so if the chunk
+ * dictionary is enabled, shingles are hashed one at a time instead. So are
+ * they with tabulation hashing, which is a few lookups per shingle.
+ */
+template<uint32_t W>
+tuple<sign_sketch<W>,vector<double>>
+construct_streamhash_sketch(const unordered_map<chunk_key,uint32_t>& shingle_vector,
+                            const hash_family& family) {
+  if (chunk_dictionary_enabled() || family.kind != HASH_MULTILINEAR)
+    return sum_chunk_hashes<W>(shingle_vector, family);
+
+  auto& H_tiles = family.H_tiles;
+  uint32_t positions = family.H[0].size();
+  uint32_t width = positions - 1; // longest possible chunk
+  uint32_t num_tiles = (W + HASH_TILE - 1) / HASH_TILE;
 
+  // unpack the shingles into rows of the byte matrix
+  static thread_local vector<uint8_t> rows;
+  static thread_local vector<uint32_t> lengths;
+  static thread_local vector<int64_t> counts;
+  uint32_t n = shingle_vector.size();
+  rows.resize(n * width);
+  lengths.resize(n);
+  counts.resize(n);
+
+  uint32_t k = 0;
+  uint8_t buffer[MAX_PACKED_CHUNK_LENGTH];
   for (auto& kv : shingle_vector) {
-    auto& shingle = kv.first;
-    auto& count = kv.second;
-    for (uint32_t i = 0; i < L; i++) {
-      projection[i] += count * hashmulti(shingle, H[i]);
+    const uint8_t* bytes;
+    lengths[k] = chunk_bytes(kv.first, &bytes, buffer);
+    copy(bytes, bytes + lengths[k], &rows[k * width]);
+    counts[k] = kv.second;
+    k++;
+  }
+
+  vector<int64_t> accumulator(num_tiles * HASH_TILE, 0);
+  switch (kernel_isa()) {
+    case ISA_AVX512:
+      accumulate_blocks_avx512(H_tiles.data(), positions, num_tiles,
+                               rows.data(), lengths.data(), counts.data(), n,
+                               accumulator.data());
+      break;
+    case ISA_AVX2:
+      accumulate_blocks_avx2(H_tiles.data(), positions, num_tiles,
+                             rows.data(), lengths.data(), counts.data(), n,
+                             accumulator.data());
+      break;
+    default:
+      accumulate_blocks_scalar(H_tiles.data(), positions, num_tiles,
+                               rows.data(), lengths.data(), counts.data(), n,
+                               accumulator.data());
+      break;
+  }
+
+  vector<double> projection(W);
+  for (uint32_t i = 0; i < W; i++) {
+    projection[i] = accumulator[i];
+  }
+
+  return make_tuple(make_sign_sketch<W>(projection), projection);
+}
+
+// Adds a chunk to the batch unless it is already there. Returns the
+// positions of the chunks in the batch.
+vector<uint32_t> add_to_chunk_batch(chunk_batch& batch,
+                                    const vector<chunk_key>& chunks) {
+  vector<uint32_t> positions;
+  positions.reserve(chunks.size());
+  for (auto& chunk : chunks) {
+    auto it = batch.index.find(chunk);
+    if (it == batch.index.end()) {
+      it = batch.index.insert(make_pair(chunk, batch.chunks.size())).first;
+      batch.chunks.push_back(chunk);
+    }
+    positions.push_back(it->second);
+  }
+  return positions;
+}
+
+void clear_chunk_batch(chunk_batch& batch) {
+  batch.chunks.clear();
+  batch.index.clear();
+}
+
+// Blocked hash bits of the rows unpacked by hash_chunk_batch, num_words
+// words per row.
+template<uint32_t C>
+static ALWAYS_INLINE void hash_blocks(const uint64_t* H_tiles,
+                                      uint32_t positions, uint32_t num_words,
+                                      const uint8_t* rows,
+                                      const uint32_t* lengths, uint32_t n,
+                                      uint64_t* bits) {
+  uint32_t width = positions - 1;
+
+  for (uint32_t block = 0; block < n; block += SHINGLE_BLOCK) {
+    uint32_t block_end = min(block + SHINGLE_BLOCK, n);
+
+    for (uint32_t t = 0; t < num_words; t++) {
+      const uint64_t* tile = H_tiles + t * positions * HASH_TILE;
+
+      for (uint32_t k = block; k < block_end; k++) {
+        uint64_t sums[HASH_TILE];
+        hash_tile<C>(tile, &rows[k * width], lengths[k], sums);
+
+        uint64_t word = 0;
+        for (uint32_t i = 0; i < HASH_TILE; i++) {
+          word |= (sums[i] >> 63) << i; // MSB
+        }
+        bits[k * num_words + t] = word;
+      }
+    }
+  }
+}
+
+// hash_blocks for the chunk length of H_tiles, compiled for each
+// instruction set
+static void hash_blocks_scalar(const uint64_t* H_tiles, uint32_t positions,
+                               uint32_t num_words, const uint8_t* rows,
+                               const uint32_t* lengths, uint32_t n,
+                               uint64_t* bits) {
+  DISPATCH_CHUNK_LENGTH(positions - 2, hash_blocks, H_tiles, positions,
+                        num_words, rows, lengths, n, bits);
+}
+
+static TARGET_AVX2 void hash_blocks_avx2(const uint64_t* H_tiles,
+                                         uint32_t positions,
+                                         uint32_t num_words,
+                                         const uint8_t* rows,
+                                         const uint32_t* lengths, uint32_t n,
+                                         uint64_t* bits) {
+  DISPATCH_CHUNK_LENGTH(positions - 2, hash_blocks, H_tiles, positions,
+                        num_words, rows, lengths, n, bits);
+}
+
+static TARGET_AVX512 void hash_blocks_avx512(const uint64_t* H_tiles,
+                                             uint32_t positions,
+                                             uint32_t num_words,
+                                             const uint8_t* rows,
+                                             const uint32_t* lengths,
+                                             uint32_t n, uint64_t* bits) {
+  DISPATCH_CHUNK_LENGTH(positions - 2, hash_blocks, H_tiles, positions,
+                        num_words, rows, lengths, n, bits);
+}
+
+/* Hashes all chunks of a batch in one sweep of H.
+ *
+ * Same blocking as the bootstrap kernel: for each block of SHINGLE_BLOCK
+ * chunks, every tile of H is applied to the whole block, so each tile is
+ * loaded once per block instead of once per chunk. Tile t gives word t of
+ * each chunk's hash bits (see hash_chunk). With the chunk dictionary
+ * enabled, memoized bits are used instead, and tabulation hashing needs no
+ * blocking.
+ */
+template<uint32_t W>
+void hash_chunk_batch(chunk_batch& batch, const hash_family& family) {
+  static_assert(HASH_TILE == 64, "a tile must fill one word of hash bits");
+  const uint32_t num_words = CHUNK_HASH_WORDS(W);
+
+  uint32_t n = batch.chunks.size();
+  batch.bits.resize(n * num_words);
+
+  if (chunk_dictionary_enabled() || family.kind != HASH_MULTILINEAR) {
+    for (uint32_t k = 0; k < n; k++) {
+      const uint64_t* bits = hash_chunk<W>(batch.chunks[k], family);
+      copy(bits, bits + num_words, &batch.bits[k * num_words]);
     }
+    return;
+  }
+
+  auto& H_tiles = family.H_tiles;
+  uint32_t positions = family.H[0].size();
+  uint32_t width = positions - 1; // longest possible chunk
+
+  // unpack the chunks into rows of a byte matrix
+  static thread_local vector<uint8_t> rows;
+  static thread_local vector<uint32_t> lengths;
+  rows.resize(n * width);
+  lengths.resize(n);
+
+  uint8_t buffer[MAX_PACKED_CHUNK_LENGTH];
+  for (uint32_t k = 0; k < n; k++) {
+    const uint8_t* bytes;
+    lengths[k] = chunk_bytes(batch.chunks[k], &bytes, buffer);
+    copy(bytes, bytes + lengths[k], &rows[k * width]);
+  }
+
+  switch (kernel_isa()) {
+    case ISA_AVX512:
+      hash_blocks_avx512(H_tiles.data(), positions, num_words, rows.data(),
+                         lengths.data(), n, batch.bits.data());
+      break;
+    case ISA_AVX2:
+      hash_blocks_avx2(H_tiles.data(), positions, num_words, rows.data(),
+                       lengths.data(), n, batch.bits.data());
+      break;
+    default:
+      hash_blocks_scalar(H_tiles.data(), positions, num_words, rows.data(),
+                         lengths.data(), n, batch.bits.data());
+      break;
   }
+}
+
+// Adds sign times the +1/-1 hash values in bits to the projection and to
+// projection_delta. Vectorized with per-lane shifts from AVX2 up.
+template<uint32_t W>
+static ALWAYS_INLINE void add_hash_bits(const uint64_t* bits, int sign,
+                                        double* projection,
+                                        int* projection_delta) {
+  for (uint32_t i = 0; i < W; i++) {
+    int delta = sign * chunk_hash_bit(bits, i);
+    projection[i] += delta;
+    projection_delta[i] += delta;
+  }
+}
+
+template<uint32_t W>
+static void add_hash_bits_scalar(const uint64_t* bits, int sign,
+                                 double* projection, int* projection_delta) {
+  add_hash_bits<W>(bits, sign, projection, projection_delta);
+}
+
+template<uint32_t W>
+static TARGET_AVX2 void add_hash_bits_avx2(const uint64_t* bits, int sign,
+                                           double* projection,
+                                           int* projection_delta) {
+  add_hash_bits<W>(bits, sign, projection, projection_delta);
+}
+
+template<uint32_t W>
+static TARGET_AVX512 void add_hash_bits_avx512(const uint64_t* bits, int sign,
+                                               double* projection,
+                                               int* projection_delta) {
+  add_hash_bits<W>(bits, sign, projection, projection_delta);
+}
+
+// Projection update of one chunk with hash bits from hash_chunk or a batch,
+// sign is +1 for an incoming chunk and -1 for an outgoing one.
+template<uint32_t W>
+void add_chunk_bits(const uint64_t* bits, int sign, vector<double>& projection,
+                    vector<int>& projection_delta) {
+  switch (kernel_isa()) {
+    case ISA_AVX512:
+      add_hash_bits_avx512<W>(bits, sign, projection.data(),
+                              projection_delta.data());
+      break;
+    case ISA_AVX2:
+      add_hash_bits_avx2<W>(bits, sign, projection.data(),
+                            projection_delta.data());
+      break;
+    default:
+      add_hash_bits_scalar<W>(bits, sign, projection.data(),
+                              projection_delta.data());
+      break;
+  }
+}
+
+// apply_chunk_delta for chunks hashed in a batch, given their positions.
+template<uint32_t W>
+vector<int> apply_chunk_delta(const vector<uint32_t>& incoming_chunks,
+                              const vector<uint32_t>& outgoing_chunks,
+                              const chunk_batch& batch,
+                              sign_sketch<W>& sketch,
+                              vector<double>& projection) {
+  vector<int> projection_delta(W, 0);
 
-  for (uint32_t i = 0; i < L; i++) {
-    sketch[i] = projection[i] >= 0 ? 1 : 0;
+  // update the projection vectors
+  for (auto& k : incoming_chunks) {
+    add_chunk_bits<W>(&batch.bits[k * CHUNK_HASH_WORDS(W)], 1, projection,
+                      projection_delta);
   }
+  for (auto& k : outgoing_chunks) {
+    add_chunk_bits<W>(&batch.bits[k * CHUNK_HASH_WORDS(W)], -1, projection,
+                      projection_delta);
+  }
+
+  sketch.dirty = true; // sketch = sign(projection), when next read
 
-  return make_tuple(sketch, projection);
+  return projection_delta;
 }
 
+/* Lazily decay a projection to the current epoch.
+ *
+ * The projection is scaled by decay^(epoch - last_epoch) only when it is
+ * touched, so idle graphs and centroids cost nothing. Scaling by a positive
+ * factor does not change any signs, so the sketch remains valid as is.
+ */
+void decay_projection(vector<double>& projection, uint32_t& last_epoch,
+                      uint32_t epoch, double decay) {
+  if (decay == 1.0 || epoch == last_epoch)
+    return;
+
+  double factor = pow(decay, static_cast<double>(epoch - last_epoch));
+  for (auto& p : projection) {
+    p *= factor;
+  }
+  last_epoch = epoch;
+}
+
+#define INSTANTIATE_STREAMHASH(W) \
+  template void compute_sign_words<W>(const double* projection, \
+                                      uint64_t* words); \
+  template sign_sketch<W> \
+    make_sign_sketch<W>(const vector<double>& projection); \
+  template const sign_sketch<W>& \
+    refresh_sketch<W>(sign_sketch<W>& sketch, \
+                      const vector<double>& projection); \
+  template uint32_t sketch_distance<W>(const sign_sketch<W>& sketch1, \
+                                       const sign_sketch<W>& sketch2); \
+  template void sketch_distances<W>(const sign_sketch<W>& sketch, \
+                                    const sign_sketch<W>* sketches, \
+                                    uint32_t num_sketches, \
+                                    uint32_t* distances); \
+  template uint32_t \
+    sketch_distance_below<W>(const sign_sketch<W>& sketch1, \
+                             const sign_sketch<W>& sketch2, uint32_t limit); \
+  template double streamhash_similarity<W>(const sign_sketch<W>& sketch1, \
+                                           const sign_sketch<W>& sketch2); \
+  template tuple<sign_sketch<W>,vector<double>> \
+    construct_streamhash_sketch<W>( \
+      const unordered_map<chunk_key,uint32_t>& shingle_vector, \
+      const hash_family& family); \
+  template void add_chunk_bits<W>(const uint64_t* bits, int sign, \
+                                  vector<double>& projection, \
+                                  vector<int>& projection_delta); \
+  template void hash_chunk_batch<W>(chunk_batch& batch, \
+                                    const hash_family& family); \
+  template vector<int> \
+    apply_chunk_delta<W>(const vector<uint32_t>& incoming_chunks, \
+                         const vector<uint32_t>& outgoing_chunks, \
+                         const chunk_batch& batch, sign_sketch<W>& sketch, \
+                         vector<double>& projection);
+FOR_EACH_SKETCH_WIDTH(INSTANTIATE_STREAMHASH)
+
 }
@@ -8,17 +8,121 @@
 #define STREAMSPOT_STREAMHASH_H_
 
 #include <bitset>
+#include "chunk.h"
 #include "param.h"
+#include <random>
+#include <string>
 #include <tuple>
 #include <unordered_map>
 #include <vector>
 
 namespace std {
 
-double streamhash_similarity(const bitset<L>& sketch1, const bitset<L>& sketch2);
-tuple<bitset<L>,vector<int>>
-construct_streamhash_sketch(const unordered_map<string,uint32_t>& shingle_vector,
-                            const vector<vector<uint64_t>>& H);
+// 64-bit words holding one sign bit per projection component, for W
+#define SKETCH_WORDS(W) (((W) + 63) / 64)
+
+// words compared at a time by sketch_distance_below
+#define CASCADE_BLOCK_WORDS (CASCADE_BLOCK_BITS / 64)
+
+/* StreamHash sketch of width W: bit i (of word i / 64) is set if component i
+ * of the projection is >= 0, unused bits of the last word are 0.
+ *
+ * Sketches are materialized lazily. Updating the projection only sets
+ * dirty, and refresh_sketch recomputes the bits when the sketch is read, so
+ * a sketch changed several times between reads is extracted once.
+ */
+template<uint32_t W>
+struct sign_sketch {
+  uint64_t words[SKETCH_WORDS(W)];
+  bool dirty;                              // words are out of date
+};
+
+// universal hash families from chunks to {+1,-1}, see hash_chunk
+enum hash_family_kind {
+  HASH_MULTILINEAR, // a 64-bit multiply per character and function
+  HASH_TABULATION   // simple tabulation, a row of bits per character
+};
+
+/* num_functions hash functions of chunks of up to max_length characters.
+ *
+ * Multilinear hashing keeps max_length + 1 random words per function in H,
+ * and also in H_tiles for the blocked kernels. Simple tabulation keeps rows
+ * of CHUNK_HASH_WORDS(num_functions) words with one random bit per function:
+ * a base row, then the row of character c at position j at 1 + j * 256 + c.
+ * A chunk's bits are the base row XORed with the row of each of its
+ * characters, so one lookup per character gives all the functions at once.
+ */
+struct hash_family {
+  hash_family_kind kind;
+  uint32_t num_functions;
+  uint32_t max_length;
+  vector<vector<uint64_t>> H;              // multilinear
+  vector<uint64_t> H_tiles;                // multilinear, see tile_hash_family
+  vector<uint64_t> tables;                 // tabulation
+};
+
+// distinct chunks changed by a batch of edges, hashed together
+struct chunk_batch {
+  vector<chunk_key> chunks;
+  unordered_map<chunk_key,uint32_t> index; // position of each chunk
+  vector<uint64_t> bits;                   // CHUNK_HASH_WORDS(W) per chunk
+};
+
+// chunks changed by one edge insertion or eviction, by position in a batch
+struct sketch_delta {
+  uint32_t gid;
+  uint32_t edge_num;                       // edge that caused the change
+  bool inserted;                           // false if evicted
+  vector<uint32_t> incoming_chunks;
+  vector<uint32_t> outgoing_chunks;
+};
+
+// W is the sketch width, one of FOR_EACH_SKETCH_WIDTH, and hash families
+// must hold W functions
+template<uint32_t W>
+void compute_sign_words(const double* projection, uint64_t* words);
+template<uint32_t W>
+sign_sketch<W> make_sign_sketch(const vector<double>& projection);
+template<uint32_t W>
+const sign_sketch<W>& refresh_sketch(sign_sketch<W>& sketch,
+                                     const vector<double>& projection);
+template<uint32_t W>
+uint32_t sketch_distance(const sign_sketch<W>& sketch1,
+                         const sign_sketch<W>& sketch2);
+template<uint32_t W>
+void sketch_distances(const sign_sketch<W>& sketch,
+                      const sign_sketch<W>* sketches, uint32_t num_sketches,
+                      uint32_t* distances);
+template<uint32_t W>
+uint32_t sketch_distance_below(const sign_sketch<W>& sketch1,
+                               const sign_sketch<W>& sketch2, uint32_t limit);
+template<uint32_t W>
+double streamhash_similarity(const sign_sketch<W>& sketch1,
+                             const sign_sketch<W>& sketch2);
+hash_family make_hash_family(hash_family_kind kind, uint32_t num_functions,
+                             uint32_t chunk_length, mt19937_64& prng);
+const char* hash_family_name(hash_family_kind kind);
+bool parse_hash_family(const string& name, hash_family_kind& kind);
+template<uint32_t W>
+tuple<sign_sketch<W>,vector<double>>
+construct_streamhash_sketch(const unordered_map<chunk_key,uint32_t>& shingle_vector,
+                            const hash_family& family);
+vector<uint32_t> add_to_chunk_batch(chunk_batch& batch,
+                                    const vector<chunk_key>& chunks);
+void clear_chunk_batch(chunk_batch& batch);
+template<uint32_t W>
+void hash_chunk_batch(chunk_batch& batch, const hash_family& family);
+template<uint32_t W>
+void add_chunk_bits(const uint64_t* bits, int sign, vector<double>& projection,
+                    vector<int>& projection_delta);
+template<uint32_t W>
+vector<int> apply_chunk_delta(const vector<uint32_t>& incoming_chunks,
+                              const vector<uint32_t>& outgoing_chunks,
+                              const chunk_batch& batch,
+                              sign_sketch<W>& sketch,
+                              vector<double>& projection);
+void decay_projection(vector<double>& projection, uint32_t& last_epoch,
+                      uint32_t epoch, double decay);
 
 }
 #endif
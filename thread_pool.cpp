@@ -0,0 +1,97 @@
+/*
+ * Copyright 2016 Emaad Ahmed Manzoor
+ * License: Apache License, Version 2.0
+ * http://www3.cs.stonybrook.edu/~emanzoor/streamspot/
+ */
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include "thread_pool.h"
+#include <vector>
+
+namespace std {
+
+thread_pool::thread_pool(uint32_t num_threads)
+  : job(nullptr), job_size(0), next_index(0), busy_workers(0),
+    generation(0), stopping(false) {
+  // the calling thread is the last one
+  for (uint32_t t = 1; t < num_threads; t++) {
+    workers.push_back(thread(&thread_pool::worker_loop, this));
+  }
+}
+
+thread_pool::~thread_pool() {
+  {
+    lock_guard<mutex> lock(m);
+    stopping = true;
+  }
+  job_cv.notify_all();
+  for (auto& w : workers) {
+    w.join();
+  }
+}
+
+void thread_pool::parallel_for(uint32_t n,
+                               const function<void(uint32_t)>& fn) {
+  if (workers.empty() || n <= 1) {
+    for (uint32_t i = 0; i < n; i++) {
+      fn(i);
+    }
+    return;
+  }
+
+  {
+    lock_guard<mutex> lock(m);
+    job = &fn;
+    job_size = n;
+    next_index = 0;
+    busy_workers = workers.size();
+    generation++;
+  }
+  job_cv.notify_all();
+
+  run_job();
+
+  // wait for the workers, so fn may go out of scope
+  unique_lock<mutex> lock(m);
+  done_cv.wait(lock, [this]{ return busy_workers == 0; });
+  job = nullptr;
+}
+
+void thread_pool::worker_loop() {
+  uint64_t seen_generation = 0;
+  while (true) {
+    {
+      unique_lock<mutex> lock(m);
+      job_cv.wait(lock, [&]{ return stopping || generation != seen_generation; });
+      if (stopping)
+        return;
+      seen_generation = generation;
+    }
+
+    run_job();
+
+    {
+      lock_guard<mutex> lock(m);
+      busy_workers--;
+    }
+    done_cv.notify_one();
+  }
+}
+
+void thread_pool::run_job() {
+  uint32_t i;
+  while ((i = next_index.fetch_add(1)) < job_size) {
+    (*job)(i);
+  }
+}
+
+uint32_t default_num_threads() {
+  uint32_t n = thread::hardware_concurrency();
+  return n == 0 ? 1 : n;
+}
+
+}
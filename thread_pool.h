@@ -0,0 +1,54 @@
+/*
+ * Copyright 2016 Emaad Ahmed Manzoor
+ * License: Apache License, Version 2.0
+ * http://www3.cs.stonybrook.edu/~emanzoor/streamspot/
+ */
+
+#ifndef STREAMSPOT_THREAD_POOL_H_
+#define STREAMSPOT_THREAD_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace std {
+
+/* Fixed set of worker threads that run parallel loops.
+ *
+ * parallel_for(n, fn) calls fn(i) once for every i in [0, n), with the
+ * calling thread helping out, and returns when all calls are done. Indices
+ * are handed out dynamically, so results are deterministic as long as each
+ * fn(i) only writes state owned by index i.
+ */
+class thread_pool {
+ public:
+  explicit thread_pool(uint32_t num_threads);
+  ~thread_pool();
+
+  uint32_t size() const { return workers.size() + 1; }
+  void parallel_for(uint32_t n, const function<void(uint32_t)>& fn);
+
+ private:
+  void worker_loop();
+  void run_job();
+
+  vector<thread> workers;
+  mutex m;
+  condition_variable job_cv;           // signals a new job or shutdown
+  condition_variable done_cv;          // signals a worker finished the job
+  const function<void(uint32_t)>* job;
+  uint32_t job_size;
+  atomic<uint32_t> next_index;
+  uint32_t busy_workers;
+  uint64_t generation;                 // number of jobs started
+  bool stopping;
+};
+
+uint32_t default_num_threads();
+
+}
+
+#endif